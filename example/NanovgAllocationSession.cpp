@@ -0,0 +1,234 @@
+// Copyright (c) 2025 vinsentli
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "NanovgAllocationSession.h"
+
+#include <chrono>
+#include <math.h>
+#include <shell/shared/renderSession/ShellParams.h>
+#include <stdlib.h>
+
+namespace igl::shell {
+
+namespace {
+
+// The backend sizes its buffers for the high-water mark of the last 120 frames, and creates
+// one buffer set per frame in flight on first use.
+constexpr int kWarmupFrames = 240;
+constexpr int kMeasuredFrames = 600;
+constexpr int kShapeRows = 8;
+constexpr int kShapeColumns = 12;
+
+// Measured one after the other, each with its own context.
+struct Phase {
+  const char* name;
+  int flags;
+};
+constexpr Phase kPhases[] = {
+    {"staging buffers", iglu::nanovg::NVG_ANTIALIAS | iglu::nanovg::NVG_STENCIL_STROKES},
+    {"ring buffers",
+     iglu::nanovg::NVG_ANTIALIAS | iglu::nanovg::NVG_STENCIL_STROKES |
+         iglu::nanovg::NVG_RING_BUFFERS},
+};
+constexpr int kNumPhases = sizeof(kPhases) / sizeof(kPhases[0]);
+
+} // namespace
+
+void* NanovgAllocationSession::allocate(void* userData, size_t size) {
+  static_cast<NanovgAllocationSession*>(userData)->allocations_++;
+  return malloc(size);
+}
+
+void NanovgAllocationSession::deallocate(void* /*userData*/, void* ptr, size_t /*size*/) {
+  free(ptr);
+}
+
+void NanovgAllocationSession::initialize() noexcept {
+  const CommandQueueDesc desc;
+  commandQueue_ = getPlatform().getDevice().createCommandQueue(desc, nullptr);
+
+  renderPass_.colorAttachments.resize(1);
+  renderPass_.colorAttachments[0] = igl::RenderPassDesc::ColorAttachmentDesc{};
+  renderPass_.colorAttachments[0].loadAction = LoadAction::Clear;
+  renderPass_.colorAttachments[0].storeAction = StoreAction::Store;
+  renderPass_.colorAttachments[0].clearColor = igl::Color(0.3f, 0.3f, 0.32f, 1.0f);
+  renderPass_.depthAttachment.loadAction = LoadAction::Clear;
+  renderPass_.depthAttachment.clearDepth = 1.0;
+  renderPass_.stencilAttachment.loadAction = LoadAction::Clear;
+  renderPass_.stencilAttachment.clearStencil = 0;
+
+  phase_ = 0;
+  createContext();
+}
+
+void NanovgAllocationSession::createContext() {
+  iglu::nanovg::ContextOptions options;
+  options.allocator.allocate = allocate;
+  options.allocator.deallocate = deallocate;
+  options.allocator.userData = this;
+  nvgContext_ =
+      iglu::nanovg::CreateContext(&getPlatform().getDevice(), kPhases[phase_].flags, options);
+  IGL_DEBUG_ASSERT(nvgContext_);
+  frame_ = 0;
+}
+
+void NanovgAllocationSession::update(igl::SurfaceTextures surfaceTextures) noexcept {
+  FramebufferDesc framebufferDesc;
+  framebufferDesc.colorAttachments[0].texture = surfaceTextures.color;
+  framebufferDesc.depthAttachment.texture = surfaceTextures.depth;
+  framebufferDesc.stencilAttachment.texture = surfaceTextures.depth;
+
+  const auto dimensions = surfaceTextures.color->getDimensions();
+  framebuffer_ = getPlatform().getDevice().createFramebuffer(framebufferDesc, nullptr);
+  IGL_DEBUG_ASSERT(framebuffer_);
+  framebuffer_->updateDrawable(surfaceTextures.color);
+
+  const CommandBufferDesc cbDesc;
+  const std::shared_ptr<ICommandBuffer> buffer =
+      commandQueue_->createCommandBuffer(cbDesc, nullptr);
+  std::shared_ptr<igl::IRenderCommandEncoder> commands =
+      buffer->createRenderCommandEncoder(renderPass_, framebuffer_);
+
+  NVGcontext* vg = nvgContext_;
+  if (frame_ == kWarmupFrames) {
+    warmAllocations_ = allocations_;
+    frameSeconds_ = 0.0;
+    iglu::nanovg::ResetRenderStats(vg);
+  }
+
+  const float pxRatio = 2.0f;
+  const float width = (float)dimensions.width / pxRatio;
+  const float height = (float)dimensions.height / pxRatio;
+  const auto start = std::chrono::steady_clock::now();
+  nvgBeginFrame(vg, width, height, pxRatio);
+  iglu::nanovg::SetRenderCommandEncoder(vg, framebuffer_.get(), commands.get(), nullptr);
+  iglu::nanovg::SetCommandBuffer(vg, buffer);
+  drawScene(vg, width, height);
+  nvgEndFrame(vg);
+  frameSeconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  commands->endEncoding();
+  if (shellParams().shouldPresent) {
+    buffer->present(surfaceTextures.color);
+  }
+  commandQueue_->submit(*buffer);
+
+  frame_++;
+  if (frame_ == kWarmupFrames + kMeasuredFrames) {
+    reportPhase();
+    if (phase_ + 1 < kNumPhases) {
+      iglu::nanovg::DestroyContext(nvgContext_);
+      phase_++;
+      createContext();
+    }
+  }
+  RenderSession::update(surfaceTextures);
+}
+
+void NanovgAllocationSession::reportPhase() {
+  iglu::nanovg::RenderStats stats;
+  iglu::nanovg::GetRenderStats(nvgContext_, &stats);
+  const uint64_t allocations = allocations_ - warmAllocations_;
+  IGL_LOG_INFO(
+      "NanovgAllocationSession: %s, %llu backend allocations in %d frames after %d, "
+      "%.1f us of CPU time and %llu uploaded bytes per frame\n",
+      kPhases[phase_].name,
+      (unsigned long long)allocations,
+      kMeasuredFrames,
+      kWarmupFrames,
+      frameSeconds_ * 1e6 / kMeasuredFrames,
+      (unsigned long long)(stats.uploadedBytes / kMeasuredFrames));
+  IGL_DEBUG_ASSERT(allocations == 0, "The backend allocated once warmed up");
+}
+
+// Fills, concave fills and strokes of every kind, with gradients and scissors. Only positions
+// and colors animate, so every frame records the same calls and vertex counts.
+void NanovgAllocationSession::drawScene(NVGcontext* vg, float width, float height) {
+  const float t = (float)frame_ / 60.0f;
+  const float cellWidth = width / kShapeColumns;
+  const float cellHeight = height / kShapeRows;
+  const float size = 0.35f * fminf(cellWidth, cellHeight);
+
+  for (int row = 0; row < kShapeRows; ++row) {
+    for (int column = 0; column < kShapeColumns; ++column) {
+      const int i = row * kShapeColumns + column;
+      const float cx = (column + 0.5f) * cellWidth;
+      const float cy = (row + 0.5f) * cellHeight;
+      const NVGcolor color =
+          nvgHSLA(fmodf(t * 0.1f + i * 0.013f, 1.0f), 0.6f, 0.5f, (unsigned char)200);
+
+      nvgSave(vg);
+      nvgTranslate(vg, cx, cy);
+      nvgRotate(vg, t + i * 0.1f);
+      if (i % 7 == 0) {
+        nvgScissor(vg, -size, -size * 0.5f, 2.0f * size, size);
+      }
+
+      nvgBeginPath(vg);
+      switch (i % 4) {
+      case 0:
+        nvgRoundedRect(vg, -size, -size, 2.0f * size, 2.0f * size, size * 0.3f);
+        break;
+      case 1:
+        nvgCircle(vg, 0.0f, 0.0f, size);
+        break;
+      case 2:
+        // Concave star, drawn with the stencil passes.
+        for (int p = 0; p < 10; ++p) {
+          const float r = (p & 1) ? size * 0.45f : size;
+          const float a = p * NVG_PI / 5.0f;
+          if (p == 0) {
+            nvgMoveTo(vg, r * cosf(a), r * sinf(a));
+          } else {
+            nvgLineTo(vg, r * cosf(a), r * sinf(a));
+          }
+        }
+        nvgClosePath(vg);
+        break;
+      default:
+        nvgEllipse(vg, 0.0f, 0.0f, size, size * 0.6f);
+        break;
+      }
+      if (i % 3 == 0) {
+        nvgFillPaint(vg,
+                     nvgLinearGradient(
+                         vg, -size, -size, size, size, color, nvgRGBA(255, 255, 255, 64)));
+      } else {
+        nvgFillColor(vg, color);
+      }
+      nvgFill(vg);
+
+      nvgStrokeColor(vg, nvgRGBA(0, 0, 0, 160));
+      nvgStrokeWidth(vg, 1.0f + (i % 3));
+      nvgLineJoin(vg, i % 2 ? NVG_ROUND : NVG_MITER);
+      nvgStroke(vg);
+      nvgRestore(vg);
+    }
+  }
+}
+
+void NanovgAllocationSession::teardown() noexcept {
+  if (nvgContext_) {
+    iglu::nanovg::DestroyContext(nvgContext_);
+    nvgContext_ = nullptr;
+  }
+}
+
+} // namespace igl::shell
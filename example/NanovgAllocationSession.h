@@ -0,0 +1,70 @@
+// Copyright (c) 2025 vinsentli
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <nanovg_igl.h>
+#include <igl/IGL.h>
+#include <nanovg.h>
+#include <shell/shared/renderSession/RenderSession.h>
+
+namespace igl::shell {
+
+/*
+ * Benchmark of the CPU allocations of the backend. Draws a scene whose calls and vertex counts
+ * do not change between frames, with a counting iglu::nanovg::Allocator installed through
+ * ContextOptions::allocator. After kWarmupFrames frames, asserts that the backend does not
+ * allocate during the next kMeasuredFrames frames, and logs the result.
+ * Allocations of the nanovg core and of IGL do not go through the allocator and are not counted.
+ * The measurement runs with staging buffers, then with NVG_RING_BUFFERS, and also logs the CPU
+ * time of the frames and their uploaded bytes for each.
+ */
+class NanovgAllocationSession : public RenderSession {
+ public:
+  explicit NanovgAllocationSession(std::shared_ptr<Platform> platform) :
+    RenderSession(std::move(platform)) {}
+  void initialize() noexcept override;
+  void update(igl::SurfaceTextures surfaceTextures) noexcept override;
+  void teardown() noexcept override;
+
+ private:
+  static void* allocate(void* userData, size_t size);
+  static void deallocate(void* userData, void* ptr, size_t size);
+
+  void createContext();
+  void reportPhase();
+  void drawScene(NVGcontext* vg, float width, float height);
+
+ private:
+  std::shared_ptr<ICommandQueue> commandQueue_;
+  RenderPassDesc renderPass_;
+
+  NVGcontext* nvgContext_ = nullptr;
+  // Index of the measured configuration, and frame of its context.
+  int phase_ = 0;
+  int frame_ = 0;
+  // Calls of the allocator of nvgContext_, and their number when the measured frames started.
+  uint64_t allocations_ = 0;
+  uint64_t warmAllocations_ = 0;
+  // CPU time from nvgBeginFrame() to nvgEndFrame() of the measured frames.
+  double frameSeconds_ = 0.0;
+};
+
+} // namespace igl::shell
@@ -139,7 +139,7 @@ void NanovgSession::update(igl::SurfaceTextures surfaceTextures) noexcept {
   std::shared_ptr<igl::IRenderCommandEncoder> commands =
       buffer->createRenderCommandEncoder(renderPass_, framebuffer_);
 
-  drawNanovg((float)dimensions.width, (float)dimensions.height, commands);
+  drawNanovg((float)dimensions.width, (float)dimensions.height, buffer, commands);
 
   commands->endEncoding();
 
@@ -153,6 +153,7 @@ void NanovgSession::update(igl::SurfaceTextures surfaceTextures) noexcept {
 
 void NanovgSession::drawNanovg(float framebuffferWidth,
                                float framebufferHeight,
+                               const std::shared_ptr<igl::ICommandBuffer>& buffer,
                                std::shared_ptr<igl::IRenderCommandEncoder> command) {
   NVGcontext* vg = nvgContext_;
 
@@ -177,6 +178,7 @@ void NanovgSession::drawNanovg(float framebuffferWidth,
       framebuffer_.get(),
       command.get(),
       (float*)&getPlatform().getDisplayContext().preRotationMatrix);
+  iglu::nanovg::SetCommandBuffer(vg, buffer);
 
   times_++;
 
@@ -71,6 +71,7 @@ class NanovgSession : public RenderSession {
  private:
   void drawNanovg(float framebuffferWidth,
                   float framebufferHeight,
+                  const std::shared_ptr<igl::ICommandBuffer>& buffer,
                   std::shared_ptr<igl::IRenderCommandEncoder> command);
   int loadDemoData(NVGcontext* vg, DemoData* data);
 
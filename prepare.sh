@@ -1,2 +1,3 @@
 cp -af patch/ igl/
 cp example/NanovgSession.* igl/shell/renderSessions/
+cp example/NanovgAllocationSession.* igl/shell/renderSessions/
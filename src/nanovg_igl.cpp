@@ -15,17 +15,50 @@
 #include "shader_opengl.h"
 #include <IGLU/simdtypes/SimdTypes.h>
 #include <igl/IGL.h>
+#include <algorithm>
 #include <math.h>
-#include <regex>
+#include <mutex>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#if IGL_BACKEND_VULKAN
+#include <igl/vulkan/Device.h>
+#include <igl/vulkan/VulkanContext.h>
+#endif
 
 #define kVertexInputIndex 0
 #define kVertexUniformBlockIndex 1
 #define kFragmentUniformBlockIndex 2
 
+// Initial capacities of the NVG_RING_BUFFERS ring buffers, they grow on demand.
+#define kVertexRingBufferSize (1024 * 1024)
+#define kIndexRingBufferSize (256 * 1024)
+#define kUniformRingBufferSize (256 * 1024)
+
+// Minimum capacities of the per frame pools, and the number of recent frames whose
+// high-water mark sizes the pools.
+#define kMinCallCapacity 128
+#define kMinVertexCapacity 4096
+#define kMinIndexCapacity 4096
+#define kMinUniformBlockSize (16 * 1024)
+
+// Frames with at most this many vertices use 16-bit indexes, 0xFFFF is left unused as it is
+// the primitive restart index.
+#define kMaxUInt16Vertices 65535
+#define kUsageHistoryFrames 120
+#define kFrameArenaAlignment 16
+
+// Number of preceding calls that NVG_SORT_CALLS searches for a call with the same state.
+#define kSortCallsWindow 64
+// Maximum number of fills drawn by one multi-draw, bounds are compared pairwise.
+#define kMaxMultiDrawFills 256
+// Maximum number of fills drawn by one batchFill(), bounds are compared pairwise.
+#define kMaxBatchedFills 64
+// Upper bound of ContextOptions::triangulateMaxVertices, ear clipping is quadratic.
+#define kMaxTriangulatedVertices 256
+
 namespace iglu::nanovg {
 
 struct igl_vector_uint2 {
@@ -37,6 +70,8 @@ enum ShaderType {
   MNVG_SHADER_FILLGRAD,
   MNVG_SHADER_FILLIMG,
   MNVG_SHADER_IMG,
+  // Same as MNVG_SHADER_FILLGRAD with an ellipse of radii `extent` instead of a rounded rect.
+  MNVG_SHADER_FILLELLIPSE,
 };
 
 enum CallType {
@@ -45,6 +80,9 @@ enum CallType {
   MNVG_CONVEXFILL,
   MNVG_STROKE,
   MNVG_TRIANGLES,
+  // Instanced quads of NVG_GLYPH_INSTANCES: triangleOffset is the vertex slot of the first
+  // GlyphInstance and triangleCount the number of glyphs.
+  MNVG_GLYPHS,
 };
 
 struct Blend {
@@ -54,6 +92,36 @@ struct Blend {
   igl::BlendFactor dstAlpha;
 };
 
+static bool blendEquals(const Blend& a, const Blend& b) {
+  return a.srcRGB == b.srcRGB && a.dstRGB == b.dstRGB && a.srcAlpha == b.srcAlpha &&
+         a.dstAlpha == b.dstAlpha;
+}
+
+// Everything the render pipelines of a context differ by. Shaders and vertex format are fixed
+// when the context is created.
+struct PipelineKey {
+  Blend blend;
+  igl::TextureFormat colorFormat;
+  igl::TextureFormat depthFormat;
+  igl::TextureFormat stencilFormat;
+  igl::PrimitiveType topology;
+  igl::ColorWriteMask colorWriteMask;
+  // Glyph instance shaders and vertex input instead of the regular ones.
+  bool glyphs = false;
+};
+
+static bool pipelineKeyEquals(const PipelineKey& a, const PipelineKey& b) {
+  return blendEquals(a.blend, b.blend) && a.colorFormat == b.colorFormat &&
+         a.depthFormat == b.depthFormat && a.stencilFormat == b.stencilFormat &&
+         a.topology == b.topology && a.colorWriteMask == b.colorWriteMask &&
+         a.glyphs == b.glyphs;
+}
+
+struct PipelineCacheEntry {
+  PipelineKey key;
+  std::shared_ptr<igl::IRenderPipelineState> pipelineState;
+};
+
 struct UniformBufferIndex {
   igl::IBuffer* buffer = nullptr;
   void* data = nullptr;
@@ -74,28 +142,97 @@ struct Call {
   UniformBufferIndex uboIndex;
   UniformBufferIndex uboIndex2;
   Blend blendFunc;
+  // Bounds of the vertices of the call, {minx, miny, maxx, maxy}. Only set with callBounds_.
+  float bounds[4];
+  // Number of fills drawn with this one by multiDrawFill() and the offset of their indirect
+  // draws, set on the first fill of the run.
+  int multiDrawCount;
+  size_t multiDrawOffset;
+  // Stencil reference of a stroke with NVG_ROLLING_STENCIL_REFS, and whether the quad at
+  // `stencilClearOffset` is drawn before the call to zero the stencil of earlier strokes.
+  uint32_t stencilRef;
+  bool clearsStencil;
+  int stencilClearOffset;
+  // Number of fills drawn with this one by batchFill() and the offset of their cover quad, set
+  // on the first fill of the batch.
+  int fillBatchCount;
+  int fillBatchCoverOffset;
+  // Framebuffer rect {x, y, width, height} that clips the call instead of the scissor mask of the
+  // shaders, see hardwareScissor(). Zero width when the call is not clipped by it.
+  int scissorRect[4];
+};
+
+// Layouts of VkDrawIndirectCommand and VkDrawIndexedIndirectCommand.
+struct DrawIndirectCommand {
+  uint32_t vertexCount;
+  uint32_t instanceCount;
+  uint32_t firstVertex;
+  uint32_t firstInstance;
+};
+
+struct DrawIndexedIndirectCommand {
+  uint32_t indexCount;
+  uint32_t instanceCount;
+  uint32_t firstIndex;
+  int32_t vertexOffset;
+  uint32_t firstInstance;
 };
 
 struct VertexUniforms {
   iglu::simdtypes::float4x4 matrix;
   iglu::simdtypes::float2 viewSize;
+  float positionScale;
+};
+
+// Instance layout of NVG_GLYPH_INSTANCES: an axis-aligned quad and its unorm16 atlas rect, which
+// the vertex shader expands into a 4 vertex strip. Stored in the vertex buffer of the frame.
+struct GlyphInstance {
+  float x;
+  float y;
+  float width;
+  float height;
+  uint16_t s0;
+  uint16_t t0;
+  uint16_t s1;
+  uint16_t t1;
+};
+static_assert(sizeof(GlyphInstance) == 24, "GlyphInstance must be tightly packed");
+
+// Converts the 6 vertices that nanovg emits per glyph into `glyph`. Fails for quads that are
+// not axis-aligned, e.g. rotated text.
+static bool setGlyphInstanceData(GlyphInstance* glyph, const NVGvertex* v) {
+  // (x0, y0) (x1, y1) (x1, y0) (x0, y0) (x0, y1) (x1, y1), see nvgText().
+  if (v[2].x != v[1].x || v[2].y != v[0].y || v[2].u != v[1].u || v[2].v != v[0].v ||
+      v[4].x != v[0].x || v[4].y != v[1].y || v[4].u != v[0].u || v[4].v != v[1].v ||
+      memcmp(&v[3], &v[0], sizeof(NVGvertex)) != 0 ||
+      memcmp(&v[5], &v[1], sizeof(NVGvertex)) != 0) {
+    return false;
+  }
+  glyph->x = v[0].x;
+  glyph->y = v[0].y;
+  glyph->width = v[1].x - v[0].x;
+  glyph->height = v[1].y - v[0].y;
+  glyph->s0 = (uint16_t)(std::clamp(v[0].u, 0.0f, 1.0f) * 65535.0f + 0.5f);
+  glyph->t0 = (uint16_t)(std::clamp(v[0].v, 0.0f, 1.0f) * 65535.0f + 0.5f);
+  glyph->s1 = (uint16_t)(std::clamp(v[1].u, 0.0f, 1.0f) * 65535.0f + 0.5f);
+  glyph->t1 = (uint16_t)(std::clamp(v[1].v, 0.0f, 1.0f) * 65535.0f + 0.5f);
+  return true;
+}
+
+// Vertex layout of NVG_COMPACT_VERTICES: snorm16 fixed-point position and unorm16 tcoord.
+struct CompactVertex {
+  int16_t x;
+  int16_t y;
+  uint16_t u;
+  uint16_t v;
 };
 
 struct FragmentUniforms {
-  iglu::simdtypes::float3x3 scissorMat;
-  iglu::simdtypes::float3x3 paintMat;
-  iglu::simdtypes::float4 innerCol;
-  iglu::simdtypes::float4 outerCol;
-  iglu::simdtypes::float2 scissorExt;
-  iglu::simdtypes::float2 scissorScale;
-  iglu::simdtypes::float2 extent;
-  float radius;
-  float feather;
-  float strokeMult;
-  float strokeThr;
-  int texType;
-  ShaderType type;
+#define NVG_CPP_UNIFORM_FIELD(cppType, glslType, metalType, name) cppType name;
+  NVG_FRAGMENT_UNIFORM_FIELDS(NVG_CPP_UNIFORM_FIELD)
+#undef NVG_CPP_UNIFORM_FIELD
 };
+static_assert(sizeof(FragmentUniforms) == 128, "See NVG_FRAGMENT_UNIFORM_FIELDS");
 
 struct Texture {
   int Id;
@@ -105,17 +242,189 @@ struct Texture {
   std::shared_ptr<igl::ISamplerState> sampler;
 };
 
+static std::shared_ptr<igl::IBuffer> createBuffer(igl::IDevice* device,
+                                                  const igl::BufferDesc& desc,
+                                                  RenderStats* stats) {
+  stats->createdBuffers++;
+  return device->createBuffer(desc, NULL);
+}
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// FNV-1a over 32-bit words. FragmentUniforms are zeroed before they are filled in, so the
+// padding hashes and compares consistently.
+static uint64_t hashFragUniforms(const FragmentUniforms& frag) {
+  uint32_t words[sizeof(FragmentUniforms) / sizeof(uint32_t)];
+  memcpy(words, &frag, sizeof(words));
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (uint32_t word : words) {
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static void* allocateMemory(const Allocator* allocator, size_t size) {
+  if (allocator->allocate) {
+    return allocator->allocate(allocator->userData, size);
+  }
+  return malloc(size);
+}
+
+static void deallocateMemory(const Allocator* allocator, void* ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (allocator->deallocate) {
+    allocator->deallocate(allocator->userData, ptr, size);
+  } else {
+    free(ptr);
+  }
+}
+
+// Standard library allocator that forwards to the Allocator of the context.
+template<typename T>
+class StlAllocator {
+ public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  explicit StlAllocator(const Allocator* allocator) : allocator_(allocator) {}
+
+  template<typename U>
+  StlAllocator(const StlAllocator<U>& other) : allocator_(other.allocator()) {}
+
+  T* allocate(size_t n) {
+    void* ptr = allocateMemory(allocator_, sizeof(T) * n);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return (T*)ptr;
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    deallocateMemory(allocator_, ptr, sizeof(T) * n);
+  }
+
+  const Allocator* allocator() const {
+    return allocator_;
+  }
+
+  template<typename U>
+  bool operator==(const StlAllocator<U>& other) const {
+    return allocator_ == other.allocator();
+  }
+
+  template<typename U>
+  bool operator!=(const StlAllocator<U>& other) const {
+    return allocator_ != other.allocator();
+  }
+
+ private:
+  const Allocator* allocator_;
+};
+
+template<typename T>
+using Vector = std::vector<T, StlAllocator<T>>;
+
+using String = std::basic_string<char, std::char_traits<char>, StlAllocator<char>>;
+
+template<typename T, typename... Args>
+static std::shared_ptr<T> makeShared(const Allocator* allocator, Args&&... args) {
+  return std::allocate_shared<T>(StlAllocator<T>(allocator), std::forward<Args>(args)...);
+}
+
+/*
+ * A heap block that the CPU-side data of a frame is bump-allocated from. The memory is left
+ * uninitialized and reset() is O(1); the block itself is only replaced when it must grow.
+ */
+class FrameArena {
+ public:
+  FrameArena() = default;
+
+  FrameArena(size_t capacity, const Allocator* allocator, RenderStats* stats) :
+    allocator_(allocator),
+    data_((unsigned char*)allocateMemory(allocator, capacity)),
+    capacity_(capacity) {
+    // Fails like the standard containers of the backend, see StlAllocator.
+    if (data_ == nullptr) {
+      throw std::bad_alloc();
+    }
+    stats->heapAllocations++;
+  }
+
+  FrameArena(FrameArena&& other) noexcept :
+    allocator_(other.allocator_),
+    data_(other.data_),
+    capacity_(other.capacity_),
+    used_(other.used_) {
+    other.data_ = nullptr;
+    other.capacity_ = 0;
+    other.used_ = 0;
+  }
+
+  FrameArena& operator=(FrameArena&& other) noexcept {
+    std::swap(allocator_, other.allocator_);
+    std::swap(data_, other.data_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(used_, other.used_);
+    return *this;
+  }
+
+  FrameArena(const FrameArena&) = delete;
+  FrameArena& operator=(const FrameArena&) = delete;
+
+  ~FrameArena() {
+    if (allocator_) {
+      deallocateMemory(allocator_, data_, capacity_);
+    }
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  unsigned char* allocate(size_t size) {
+    const size_t offset = alignUp(used_, kFrameArenaAlignment);
+    assert(offset + size <= capacity_);
+    used_ = offset + size;
+    return data_ + offset;
+  }
+
+  void reset() {
+    used_ = 0;
+  }
+
+ private:
+  const Allocator* allocator_ = nullptr;
+  unsigned char* data_ = nullptr;
+  size_t capacity_ = 0;
+  size_t used_ = 0;
+};
+
 class UniformBufferBlock {
  public:
-  UniformBufferBlock(igl::IDevice* device, size_t blockSize) : blockSize_(blockSize) {
+  UniformBufferBlock(igl::IDevice* device,
+                     size_t blockSize,
+                     size_t baseOffset,
+                     bool createGpuBuffer,
+                     const Allocator* allocator,
+                     RenderStats* stats) :
+    data_(StlAllocator<unsigned char>(allocator)), blockSize_(blockSize), baseOffset_(baseOffset) {
     data_.resize(blockSize);
-    igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Uniform,
-                         data_.data(),
-                         blockSize,
-                         igl::ResourceStorage::Shared);
-    desc.hint = igl::BufferDesc::BufferAPIHintBits::UniformBlock;
-    desc.debugName = "fragment_uniform_buffer";
-    buffer_ = device->createBuffer(desc, NULL);
+    stats->heapAllocations++;
+    if (createGpuBuffer) {
+      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Uniform,
+                           data_.data(),
+                           blockSize,
+                           igl::ResourceStorage::Shared);
+      desc.hint = igl::BufferDesc::BufferAPIHintBits::UniformBlock;
+      desc.debugName = "fragment_uniform_buffer";
+      buffer_ = createBuffer(device, desc, stats);
+    }
   }
 
   ~UniformBufferBlock() {
@@ -136,8 +445,30 @@ class UniformBufferBlock {
     return index;
   }
 
-  void uploadToGpu() {
-    buffer_->upload(data_.data(), igl::BufferRange(data_.size()));
+  // Uploads only the allocated prefix of the block, returns the number of uploaded bytes.
+  size_t uploadToGpu() {
+    return uploadToBuffer(buffer_.get(), 0);
+  }
+
+  size_t uploadToBuffer(igl::IBuffer* buffer, size_t offset) {
+    if (current_ == 0) {
+      return 0;
+    }
+    buffer->upload(data_.data(), igl::BufferRange(current_, offset));
+    return current_;
+  }
+
+  size_t usedSize() const {
+    return current_;
+  }
+
+  size_t blockSize() const {
+    return blockSize_;
+  }
+
+  // Offset of the block from the start of its pool.
+  size_t baseOffset() const {
+    return baseOffset_;
   }
 
   void reset() {
@@ -146,35 +477,109 @@ class UniformBufferBlock {
 
  private:
   std::shared_ptr<igl::IBuffer> buffer_;
-  std::vector<unsigned char> data_;
+  Vector<unsigned char> data_;
   size_t blockSize_ = 0;
+  size_t baseOffset_ = 0;
   size_t current_ = 0;
 };
 
+class RingBuffer;
+
 class UniformBufferPool {
  public:
-  UniformBufferPool(igl::IDevice* device, size_t blockSize) :
-    device_(device), blockSize_(blockSize) {
-    allocNewBlock();
+  /*
+   * Blocks are between `minBlockSize` and `maxBlockSize` bytes, multiples of `allocUnit`.
+   * When `createGpuBuffers` is false the blocks are CPU staging only: allocated indexes have no
+   * buffer and their offset is relative to the start of the pool, see uploadToRingBuffer().
+   */
+  UniformBufferPool(igl::IDevice* device,
+                    size_t minBlockSize,
+                    size_t maxBlockSize,
+                    size_t allocUnit,
+                    bool createGpuBuffers,
+                    const Allocator* allocator,
+                    RenderStats* stats) :
+    bufferBlocks_(StlAllocator<std::shared_ptr<UniformBufferBlock>>(allocator)),
+    device_(device),
+    minBlockSize_(alignUp(std::min(minBlockSize, maxBlockSize), allocUnit)),
+    maxBlockSize_(maxBlockSize / allocUnit * allocUnit),
+    allocUnit_(allocUnit),
+    createGpuBuffers_(createGpuBuffers),
+    allocator_(allocator),
+    stats_(stats) {
+    allocNewBlock(minBlockSize_);
   }
 
   UniformBufferIndex allocData(size_t dataSize) {
     if (!bufferBlocks_[currentBlockIndex]->checkLeftSpace(dataSize)) {
       currentBlockIndex++;
       if (bufferBlocks_.size() <= currentBlockIndex) {
-        allocNewBlock();
+        // Grows geometrically while a frame is recorded, reserve() avoids this in steady state.
+        stats_->frameGrowths++;
+        allocNewBlock(std::max(dataSize, capacity()));
       }
     }
 
-    return bufferBlocks_[currentBlockIndex]->allocData(dataSize);
+    UniformBufferIndex index = bufferBlocks_[currentBlockIndex]->allocData(dataSize);
+    if (!createGpuBuffers_) {
+      index.offset += bufferBlocks_[currentBlockIndex]->baseOffset();
+    }
+    return index;
   }
 
-  void uploadToGpu() {
-    for (auto& block : bufferBlocks_) {
-      block->uploadToGpu();
+  size_t capacity() const {
+    const auto& last = bufferBlocks_.back();
+    return last->baseOffset() + last->blockSize();
+  }
+
+  size_t usedSize() const {
+    const auto& current = bufferBlocks_[currentBlockIndex];
+    return current->baseOffset() + current->usedSize();
+  }
+
+  // Must be called between frames.
+  void reserve(size_t size) {
+    while (capacity() < size) {
+      allocNewBlock(size - capacity());
+    }
+  }
+
+  // Must be called between frames. Releases trailing blocks that are not needed for `size`
+  // bytes, and rebuilds the pool when a single large block is left.
+  void shrink(size_t size) {
+    while (bufferBlocks_.size() > 1 &&
+           bufferBlocks_.back()->baseOffset() >= std::max(size, minBlockSize_)) {
+      bufferBlocks_.pop_back();
+    }
+    const size_t target = alignUp(std::max(size, minBlockSize_), allocUnit_);
+    if (capacity() > 2 * target) {
+      bufferBlocks_.clear();
+      allocNewBlock(target);
+    }
+  }
+
+  // Blocks after currentBlockIndex were not touched this frame and are skipped.
+  size_t uploadToGpu() const {
+    size_t uploadedBytes = 0;
+    for (size_t i = 0; i <= currentBlockIndex; ++i) {
+      uploadedBytes += bufferBlocks_[i]->uploadToGpu();
+    }
+    return uploadedBytes;
+  }
+
+  // Uploads the blocks used this frame to `buffer`, each at `base` plus its offset in the pool.
+  // Returns the number of uploaded bytes.
+  size_t uploadToBuffer(igl::IBuffer* buffer, size_t base) const {
+    size_t uploadedBytes = 0;
+    for (size_t i = 0; i <= currentBlockIndex; ++i) {
+      uploadedBytes +=
+          bufferBlocks_[i]->uploadToBuffer(buffer, base + bufferBlocks_[i]->baseOffset());
     }
+    return uploadedBytes;
   }
 
+  size_t uploadToRingBuffer(RingBuffer& ring, uint64_t frame, size_t* uploadedBytes);
+
   void reset() {
     currentBlockIndex = 0;
     for (auto& block : bufferBlocks_) {
@@ -183,63 +588,474 @@ class UniformBufferPool {
   }
 
  private:
-  void allocNewBlock() {
-    bufferBlocks_.emplace_back(std::make_shared<UniformBufferBlock>(device_, blockSize_));
+  void allocNewBlock(size_t blockSize) {
+    blockSize = std::clamp(alignUp(blockSize, allocUnit_), minBlockSize_, maxBlockSize_);
+    const size_t baseOffset = bufferBlocks_.empty() ? 0 : capacity();
+    bufferBlocks_.emplace_back(makeShared<UniformBufferBlock>(
+        allocator_, device_, blockSize, baseOffset, createGpuBuffers_, allocator_, stats_));
   }
 
  private:
-  std::vector<std::shared_ptr<UniformBufferBlock>> bufferBlocks_;
-  size_t blockSize_ = 0;
+  Vector<std::shared_ptr<UniformBufferBlock>> bufferBlocks_;
   igl::IDevice* device_ = nullptr;
+  size_t minBlockSize_ = 0;
+  size_t maxBlockSize_ = 0;
+  size_t allocUnit_ = 0;
+  bool createGpuBuffers_ = true;
+  const Allocator* allocator_ = nullptr;
+  RenderStats* stats_ = nullptr;
   size_t currentBlockIndex = 0;
 };
 
+/*
+ * A long-lived GPU buffer that frames sub-allocate from in FIFO order.
+ * Each allocation is tagged with its frame and stays reserved until that frame is retired.
+ * When the live ranges leave no room the buffer is recreated with a larger capacity; the old
+ * buffer is kept alive by the Buffers sets that still reference it.
+ * A `mapped` ring keeps its buffer mapped, so that frames write into their ranges directly.
+ */
+class RingBuffer {
+ public:
+  RingBuffer(igl::IDevice* device,
+             igl::BufferDesc::BufferType type,
+             const char* debugName,
+             size_t alignment,
+             size_t capacity,
+             bool mapped,
+             const Allocator* allocator,
+             RenderStats* stats) :
+    device_(device),
+    type_(type),
+    debugName_(debugName),
+    alignment_(alignment),
+    mapped_(mapped),
+    stats_(stats),
+    regions_(StlAllocator<Region>(allocator)) {
+    recreate(alignUp(capacity, alignment_));
+  }
+
+  const std::shared_ptr<igl::IBuffer>& buffer() const {
+    return buffer_;
+  }
+
+  // The mapped contents of buffer(), null unless the ring is mapped.
+  unsigned char* data() const {
+    return data_;
+  }
+
+  size_t allocate(uint64_t frame, size_t size) {
+    size = alignUp(std::max(size, (size_t)1), alignment_);
+
+    size_t offset = 0;
+    if (!findSpace(size, &offset)) {
+      recreate(std::max(capacity_ * 2, size * 2));
+      offset = 0;
+    }
+
+    head_ = offset + size;
+    if (regions_.size() == regions_.capacity() && firstRegion_ > 0) {
+      // Compacts instead of growing, the number of live regions is bounded by the frames in
+      // flight.
+      regions_.erase(regions_.begin(), regions_.begin() + firstRegion_);
+      firstRegion_ = 0;
+    }
+    regions_.push_back({frame, offset});
+    return offset;
+  }
+
+  // Gives back the end of the latest allocation, of which only `size` bytes are used.
+  void shrinkLast(size_t size) {
+    IGL_DEBUG_ASSERT(firstRegion_ < regions_.size());
+    head_ = regions_.back().begin + alignUp(std::max(size, (size_t)1), alignment_);
+  }
+
+  void retire(uint64_t frame) {
+    while (firstRegion_ < regions_.size() && regions_[firstRegion_].frame <= frame) {
+      firstRegion_++;
+    }
+    if (firstRegion_ == regions_.size()) {
+      regions_.clear();
+      firstRegion_ = 0;
+    }
+  }
+
+ private:
+  struct Region {
+    uint64_t frame;
+    size_t begin;
+  };
+
+  bool findSpace(size_t size, size_t* offset) const {
+    if (firstRegion_ == regions_.size()) {
+      *offset = 0;
+      return size <= capacity_;
+    }
+
+    const size_t tail = regions_[firstRegion_].begin;
+    if (head_ > tail) {
+      if (head_ + size <= capacity_) {
+        *offset = head_;
+        return true;
+      }
+      *offset = 0;
+      return size <= tail;
+    }
+
+    *offset = head_;
+    return head_ + size <= tail;
+  }
+
+  void recreate(size_t capacity) {
+    igl::BufferDesc desc(type_, nullptr, capacity, igl::ResourceStorage::Shared);
+    if (type_ == igl::BufferDesc::BufferTypeBits::Uniform) {
+      desc.hint = igl::BufferDesc::BufferAPIHintBits::UniformBlock;
+    }
+    desc.debugName = debugName_;
+    buffer_ = createBuffer(device_, desc, stats_);
+    // Shared buffers stay mapped on Metal and Vulkan, the mapping is never given back.
+    if (mapped_) {
+      data_ = (unsigned char*)buffer_->map(igl::BufferRange(capacity), nullptr);
+      IGL_DEBUG_ASSERT(data_ != nullptr);
+    }
+    capacity_ = capacity;
+    head_ = 0;
+    regions_.clear();
+    firstRegion_ = 0;
+  }
+
+ private:
+  igl::IDevice* device_ = nullptr;
+  igl::BufferDesc::BufferType type_;
+  const char* debugName_;
+  size_t alignment_ = 16;
+  bool mapped_ = false;
+  RenderStats* stats_ = nullptr;
+  std::shared_ptr<igl::IBuffer> buffer_;
+  unsigned char* data_ = nullptr;
+  size_t capacity_ = 0;
+  size_t head_ = 0;
+  // Live regions are [firstRegion_, size()), oldest first.
+  Vector<Region> regions_;
+  size_t firstRegion_ = 0;
+};
+
+size_t UniformBufferPool::uploadToRingBuffer(RingBuffer& ring,
+                                             uint64_t frame,
+                                             size_t* uploadedBytes) {
+  const size_t base = ring.allocate(frame, usedSize());
+  *uploadedBytes += uploadToBuffer(ring.buffer().get(), base);
+  return base;
+}
+
+// A fragment uniform block written this frame, keyed by the hash of its content.
+struct UniformSlot {
+  uint64_t hash = 0;
+  // Slots of other generations are empty, this resets the table in O(1) between frames.
+  uint32_t generation = 0;
+  UniformBufferIndex index;
+};
+
 struct Buffers {
-  std::shared_ptr<igl::ICommandBuffer> commandBuffer;
-  bool isBusy = false;
   int image = 0;
   std::shared_ptr<igl::IBuffer> vertexUniformBuffer;
   VertexUniforms vertexUniforms;
   std::shared_ptr<igl::ITexture> stencilTexture;
-  std::vector<Call> calls;
+  // Calls are laid out in `callArena`, vertex and index staging in `arena`, see resizeArena().
+  FrameArena callArena;
+  FrameArena arena;
+  Call* calls = nullptr;
   int ccalls = 0;
   int ncalls = 0;
   std::shared_ptr<igl::IBuffer> indexBuffer;
-  std::vector<uint32_t> indexes;
+  size_t indexBufferOffset = 0;
+  // Index staging of cindexes * sizeof(uint32_t) bytes, holding indexes of indexSize bytes.
+  // Frames use 16-bit indexes until they address more than kMaxUInt16Vertices vertices.
+  // With mapped rings, the frame's region of cindexes * indexSize bytes in the index ring.
+  unsigned char* indexes = nullptr;
+  int indexSize = sizeof(uint16_t);
   int cindexes = 0;
   int nindexes = 0;
   std::shared_ptr<igl::IBuffer> vertBuffer;
-  std::vector<NVGvertex> verts;
+  size_t vertBufferOffset = 0;
+  // Vertex staging of cverts * vertexSize bytes, holding NVGvertex or CompactVertex.
+  // With mapped rings, the frame's region in the vertex ring.
+  unsigned char* verts = nullptr;
+  int vertexSize = sizeof(NVGvertex);
   int cverts = 0;
   int nverts = 0;
   std::shared_ptr<UniformBufferPool> uniformBufferPool;
-
-  Buffers(igl::IDevice* device, size_t uniformBufferBlockSize) {
+  // False with push constants or the paint table, where the pool is CPU staging only.
+  bool uploadUniforms = true;
+  // Only used with the paint table, holds the uniform pool of the frame.
+  std::shared_ptr<igl::IBuffer> paintTableBuffer;
+  // Only used with multiDrawFills_, the indirect draws of the frame and their staging.
+  std::shared_ptr<igl::IBuffer> indirectBuffer;
+  Vector<unsigned char> indirectCommands;
+  // Only used with NVG_ROLLING_STENCIL_REFS, the stencil clear quad drawn after the last call.
+  int stencilClearOffset = -1;
+  // Only used with NVG_RING_BUFFERS, where fragment uniforms live in a ring buffer.
+  std::shared_ptr<igl::IBuffer> uniformBuffer;
+  size_t uniformBufferOffset = 0;
+  // Only set with mapped NVG_RING_BUFFERS rings, which vertices and indexes are written into
+  // instead of the arena, see reserveRingRegions(). `ringFrame` tags the regions of the frame.
+  RingBuffer* mappedVertexRing = nullptr;
+  RingBuffer* mappedIndexRing = nullptr;
+  uint64_t ringFrame = 0;
+  // Open-addressing table of the distinct fragment uniform blocks of the frame.
+  Vector<UniformSlot> uniformSlots;
+  uint32_t uniformGeneration = 1;
+  int nuniformSlots = 0;
+  const Allocator* allocator = nullptr;
+
+  Buffers(igl::IDevice* device,
+          size_t minUniformBlockSize,
+          size_t maxUniformBlockSize,
+          size_t uniformAllocUnit,
+          int vertexSize,
+          bool ringBuffers,
+          bool cpuUniforms,
+          const Allocator* allocator,
+          RenderStats* stats) :
+    vertexSize(vertexSize),
+    uploadUniforms(!cpuUniforms),
+    indirectCommands(StlAllocator<unsigned char>(allocator)),
+    uniformSlots(StlAllocator<UniformSlot>(allocator)),
+    allocator(allocator) {
     vertexUniforms.matrix = iglu::simdtypes::float4x4(1.0f);
-    uniformBufferPool = std::make_shared<UniformBufferPool>(device, uniformBufferBlockSize);
+    vertexUniforms.positionScale = 1.0f;
+    stats->heapAllocations++;
+    uniformBufferPool = makeShared<UniformBufferPool>(allocator,
+                                                      device,
+                                                      minUniformBlockSize,
+                                                      maxUniformBlockSize,
+                                                      uniformAllocUnit,
+                                                      !ringBuffers && !cpuUniforms,
+                                                      allocator,
+                                                      stats);
   }
 
   ~Buffers() {
     IGL_LOG_DEBUG("iglu::nanovg::Buffers::~Buffers()\n");
   }
 
-  void uploadToGpu() {
-    if (vertBuffer) {
-      vertBuffer->upload(verts.data(), igl::BufferRange(verts.size() * sizeof(NVGvertex)));
+  // Lays out `newCcalls` calls in the call arena, and `newCverts` vertices and `newCindexes`
+  // 32-bit indexes in the arena, keeping what the frame wrote so far. The blocks are reused
+  // between frames when they are large enough and at most twice the size needed.
+  // Calls have their own block: renderers keep a pointer to their call while they allocate
+  // vertices and indexes, which must not move it.
+  void resizeArena(int newCcalls, int newCverts, int newCindexes, RenderStats* stats) {
+    if (newCcalls != ccalls) {
+      const size_t callBytes = sizeof(Call) * newCcalls;
+      FrameArena previous;
+      if (ncalls > 0 || callArena.capacity() < callBytes ||
+          callArena.capacity() > 2 * callBytes) {
+        previous = std::move(callArena);
+        callArena = FrameArena(callBytes, allocator, stats);
+      }
+      callArena.reset();
+
+      Call* newCalls = (Call*)callArena.allocate(callBytes);
+      if (previous.capacity() > 0) {
+        memcpy(newCalls, calls, sizeof(Call) * ncalls);
+      }
+      calls = newCalls;
+      ccalls = newCcalls;
+    }
+
+    if (newCverts == cverts && newCindexes == cindexes) {
+      return;
+    }
+
+    if (mappedVertexRing != nullptr) {
+      // Between frames only the capacities change, reserveRingRegions() uses them.
+      if (verts != nullptr && newCverts != cverts) {
+        verts = reserveRingRegion(*mappedVertexRing,
+                                  (size_t)vertexSize * newCverts,
+                                  verts,
+                                  (size_t)vertexSize * nverts,
+                                  &vertBuffer,
+                                  &vertBufferOffset);
+      }
+      if (indexes != nullptr && newCindexes != cindexes) {
+        indexes = reserveRingRegion(*mappedIndexRing,
+                                    (size_t)indexSize * newCindexes,
+                                    indexes,
+                                    (size_t)indexSize * nindexes,
+                                    &indexBuffer,
+                                    &indexBufferOffset);
+      }
+      cverts = newCverts;
+      cindexes = newCindexes;
+      return;
+    }
+
+    const size_t vertBytes = alignUp((size_t)vertexSize * newCverts, kFrameArenaAlignment);
+    const size_t indexBytes = sizeof(uint32_t) * newCindexes;
+    const size_t size = vertBytes + indexBytes;
+
+    FrameArena previous;
+    if (nverts > 0 || nindexes > 0 || arena.capacity() < size || arena.capacity() > 2 * size) {
+      previous = std::move(arena);
+      arena = FrameArena(size, allocator, stats);
+    }
+    arena.reset();
+
+    unsigned char* newVerts = arena.allocate(vertBytes);
+    unsigned char* newIndexes = arena.allocate(indexBytes);
+    if (previous.capacity() > 0) {
+      memcpy(newVerts, verts, (size_t)vertexSize * nverts);
+      memcpy(newIndexes, indexes, (size_t)indexSize * nindexes);
+    }
+
+    verts = newVerts;
+    indexes = newIndexes;
+    cverts = newCverts;
+    cindexes = newCindexes;
+  }
+
+  // Reserves `size` bytes of `ring` for the frame and copies the `used` bytes of `data` there.
+  // `buffer` and `offset` are set to the new region, which is returned. Reading `data` back from
+  // mapped memory is slow, this only happens when a frame outgrows its planned capacities.
+  unsigned char* reserveRingRegion(RingBuffer& ring,
+                                   size_t size,
+                                   const unsigned char* data,
+                                   size_t used,
+                                   std::shared_ptr<igl::IBuffer>* buffer,
+                                   size_t* offset) {
+    // Keeps `data` alive if the ring recreates its buffer.
+    const std::shared_ptr<igl::IBuffer> previous = std::move(*buffer);
+    *offset = ring.allocate(ringFrame, size);
+    *buffer = ring.buffer();
+    unsigned char* region = ring.data() + *offset;
+    if (used > 0) {
+      memcpy(region, data, used);
+    }
+    return region;
+  }
+
+  // Points `verts` and `indexes` at new regions of the rings, sized for the capacities.
+  void reserveRingRegions(uint64_t frameIndex) {
+    ringFrame = frameIndex;
+    verts = reserveRingRegion(*mappedVertexRing,
+                              (size_t)vertexSize * cverts,
+                              nullptr,
+                              0,
+                              &vertBuffer,
+                              &vertBufferOffset);
+    indexes = reserveRingRegion(*mappedIndexRing,
+                                (size_t)indexSize * cindexes,
+                                nullptr,
+                                0,
+                                &indexBuffer,
+                                &indexBufferOffset);
+  }
+
+  // Gives back the parts of the regions that the frame did not write.
+  void releaseRingRegions() {
+    mappedVertexRing->shrinkLast((size_t)vertexSize * nverts);
+    mappedIndexRing->shrinkLast((size_t)indexSize * nindexes);
+    verts = nullptr;
+    indexes = nullptr;
+  }
+
+  void resetUniformSlots() {
+    nuniformSlots = 0;
+    if (++uniformGeneration == 0) {
+      for (UniformSlot& slot : uniformSlots) {
+        slot.generation = 0;
+      }
+      uniformGeneration = 1;
+    }
+  }
+
+  igl::IndexFormat indexFormat() const {
+    return indexSize == sizeof(uint16_t) ? igl::IndexFormat::UInt16 : igl::IndexFormat::UInt32;
+  }
+
+  // Uploads only the vertices, indexes and uniforms written this frame, not the capacity.
+  // Returns the number of uploaded bytes.
+  size_t uploadToGpu() {
+    size_t uploadedBytes = 0;
+
+    if (vertBuffer && nverts > 0) {
+      vertBuffer->upload(verts, igl::BufferRange(nverts * vertexSize));
+      uploadedBytes += nverts * vertexSize;
     }
 
-    if (indexBuffer) {
-      indexBuffer->upload(indexes.data(), igl::BufferRange(indexes.size() * sizeof(uint32_t)));
+    if (indexBuffer && nindexes > 0) {
+      indexBuffer->upload(indexes, igl::BufferRange(nindexes * indexSize));
+      uploadedBytes += nindexes * indexSize;
     }
 
     if (vertexUniformBuffer) {
       vertexUniformBuffer->upload(&vertexUniforms, igl::BufferRange(sizeof(VertexUniforms)));
+      uploadedBytes += sizeof(VertexUniforms);
     }
 
-    uniformBufferPool->uploadToGpu();
+    if (uploadUniforms) {
+      uploadedBytes += uniformBufferPool->uploadToGpu();
+    }
+    return uploadedBytes;
+  }
+
+  size_t uploadToRingBuffers(RingBuffer& vertexRing,
+                             RingBuffer& indexRing,
+                             RingBuffer* uniformRing,
+                             uint64_t frame) {
+    size_t uploadedBytes = 0;
+
+    if (mappedVertexRing != nullptr) {
+      // Vertices and indexes were written in place.
+      releaseRingRegions();
+    } else {
+      vertBufferOffset = vertexRing.allocate(frame, nverts * vertexSize);
+      vertBuffer = vertexRing.buffer();
+      if (nverts > 0) {
+        vertBuffer->upload(verts, igl::BufferRange(nverts * vertexSize, vertBufferOffset));
+        uploadedBytes += nverts * vertexSize;
+      }
+
+      indexBufferOffset = indexRing.allocate(frame, nindexes * indexSize);
+      indexBuffer = indexRing.buffer();
+      if (nindexes > 0) {
+        indexBuffer->upload(indexes,
+                            igl::BufferRange(nindexes * indexSize, indexBufferOffset));
+        uploadedBytes += nindexes * indexSize;
+      }
+    }
+
+    if (vertexUniformBuffer) {
+      vertexUniformBuffer->upload(&vertexUniforms, igl::BufferRange(sizeof(VertexUniforms)));
+      uploadedBytes += sizeof(VertexUniforms);
+    }
+
+    if (uploadUniforms) {
+      uniformBufferOffset =
+          uniformBufferPool->uploadToRingBuffer(*uniformRing, frame, &uploadedBytes);
+      uniformBuffer = uniformRing->buffer();
+    }
+    return uploadedBytes;
   }
 };
 
+// Sizes used by one frame, the capacities of new frames follow the recent maximum.
+struct FrameUsage {
+  int calls = 0;
+  int verts = 0;
+  int indexes = 0;
+  size_t uniformBytes = 0;
+};
+
+// The Buffers sets of every nvgBeginFrame/nvgEndFrame cycle encoded into one command buffer.
+struct Submission {
+  explicit Submission(const Allocator* allocator) :
+    buffers(StlAllocator<std::shared_ptr<Buffers>>(allocator)) {}
+
+  std::shared_ptr<igl::ICommandBuffer> commandBuffer;
+  Vector<std::shared_ptr<Buffers>> buffers;
+  uint64_t lastFrame = 0;
+};
+
 static bool convertBlendFuncFactor(int factor, igl::BlendFactor* result) {
   if (factor == NVG_ZERO)
     *result = igl::BlendFactor::Zero;
@@ -268,6 +1084,269 @@ static bool convertBlendFuncFactor(int factor, igl::BlendFactor* result) {
   return true;
 }
 
+// Same as nvg__compositeOperationState() of nanovg.c, which is not exported.
+static NVGcompositeOperationState compositeOperationState(int op) {
+  int sfactor = NVG_ONE;
+  int dfactor = NVG_ONE_MINUS_SRC_ALPHA;
+  if (op == NVG_SOURCE_OVER) {
+    sfactor = NVG_ONE;
+    dfactor = NVG_ONE_MINUS_SRC_ALPHA;
+  } else if (op == NVG_SOURCE_IN) {
+    sfactor = NVG_DST_ALPHA;
+    dfactor = NVG_ZERO;
+  } else if (op == NVG_SOURCE_OUT) {
+    sfactor = NVG_ONE_MINUS_DST_ALPHA;
+    dfactor = NVG_ZERO;
+  } else if (op == NVG_ATOP) {
+    sfactor = NVG_DST_ALPHA;
+    dfactor = NVG_ONE_MINUS_SRC_ALPHA;
+  } else if (op == NVG_DESTINATION_OVER) {
+    sfactor = NVG_ONE_MINUS_DST_ALPHA;
+    dfactor = NVG_ONE;
+  } else if (op == NVG_DESTINATION_IN) {
+    sfactor = NVG_ZERO;
+    dfactor = NVG_SRC_ALPHA;
+  } else if (op == NVG_DESTINATION_OUT) {
+    sfactor = NVG_ZERO;
+    dfactor = NVG_ONE_MINUS_SRC_ALPHA;
+  } else if (op == NVG_DESTINATION_ATOP) {
+    sfactor = NVG_ONE_MINUS_DST_ALPHA;
+    dfactor = NVG_SRC_ALPHA;
+  } else if (op == NVG_LIGHTER) {
+    sfactor = NVG_ONE;
+    dfactor = NVG_ONE;
+  } else if (op == NVG_COPY) {
+    sfactor = NVG_ONE;
+    dfactor = NVG_ZERO;
+  } else if (op == NVG_XOR) {
+    sfactor = NVG_ONE_MINUS_DST_ALPHA;
+    dfactor = NVG_ONE_MINUS_SRC_ALPHA;
+  }
+
+  NVGcompositeOperationState state;
+  state.srcRGB = sfactor;
+  state.dstRGB = dfactor;
+  state.srcAlpha = sfactor;
+  state.dstAlpha = dfactor;
+  return state;
+}
+
+static void initBounds(float* bounds) {
+  bounds[0] = bounds[1] = 1e6f;
+  bounds[2] = bounds[3] = -1e6f;
+}
+
+static void expandBounds(float* bounds, const NVGvertex* verts, int n) {
+  for (int i = 0; i < n; ++i) {
+    bounds[0] = std::min(bounds[0], verts[i].x);
+    bounds[1] = std::min(bounds[1], verts[i].y);
+    bounds[2] = std::max(bounds[2], verts[i].x);
+    bounds[3] = std::max(bounds[3], verts[i].y);
+  }
+}
+
+// Touching bounds count as overlapping, a pixel on the shared edge may be drawn by both.
+static bool boundsOverlap(const float* a, const float* b) {
+  return a[0] <= b[2] && b[0] <= a[2] && a[1] <= b[3] && b[1] <= a[3];
+}
+
+// An axis-aligned rounded rect or ellipse that a convex path approximates, see fitAnalyticShape().
+struct AnalyticShape {
+  float cx;
+  float cy;
+  float hx;
+  float hy;
+  float radius;
+  bool ellipse;
+};
+
+// Signed distance of (x, y) to the outline of `shape`, exact for rounded rects and first order
+// for ellipses like the shaders.
+static float analyticShapeDistance(const AnalyticShape& shape, float x, float y) {
+  float px = fabsf(x - shape.cx);
+  float py = fabsf(y - shape.cy);
+  if (shape.ellipse) {
+    float k0 = sqrtf((px * px) / (shape.hx * shape.hx) + (py * py) / (shape.hy * shape.hy));
+    float k1 = sqrtf((px * px) / (shape.hx * shape.hx * shape.hx * shape.hx) +
+                     (py * py) / (shape.hy * shape.hy * shape.hy * shape.hy));
+    return k1 > 0.0f ? k0 * (k0 - 1.0f) / k1 : -std::min(shape.hx, shape.hy);
+  }
+  float dx = px - (shape.hx - shape.radius);
+  float dy = py - (shape.hy - shape.radius);
+  float outside = sqrtf(std::max(dx, 0.0f) * std::max(dx, 0.0f) +
+                        std::max(dy, 0.0f) * std::max(dy, 0.0f));
+  return std::min(std::max(dx, dy), 0.0f) + outside - shape.radius;
+}
+
+// Whether the outline of `path` is an axis-aligned rect, rounded rect, circle or ellipse, as
+// nvgRect(), nvgRoundedRect(), nvgCircle() and nvgEllipse() produce without rotation. With anti-
+// aliasing the outline is the middle of the fringe, the fill vertices are inset.
+static bool fitAnalyticShape(const NVGpath* path, AnalyticShape* shape) {
+  const bool fringe = path->nstroke > 0;
+  if (fringe ? (path->nbevel > 0 || path->nstroke % 2 != 0 || path->nstroke < 8)
+             : path->nfill < 4) {
+    return false;
+  }
+  const int npoints = fringe ? path->nstroke / 2 : path->nfill;
+  auto point = [path, fringe](int i, float* x, float* y) {
+    if (fringe) {
+      *x = (path->stroke[i * 2].x + path->stroke[i * 2 + 1].x) * 0.5f;
+      *y = (path->stroke[i * 2].y + path->stroke[i * 2 + 1].y) * 0.5f;
+    } else {
+      *x = path->fill[i].x;
+      *y = path->fill[i].y;
+    }
+  };
+
+  float bounds[4];
+  initBounds(bounds);
+  for (int i = 0; i < npoints; ++i) {
+    float x, y;
+    point(i, &x, &y);
+    bounds[0] = std::min(bounds[0], x);
+    bounds[1] = std::min(bounds[1], y);
+    bounds[2] = std::max(bounds[2], x);
+    bounds[3] = std::max(bounds[3], y);
+  }
+  shape->cx = (bounds[0] + bounds[2]) * 0.5f;
+  shape->cy = (bounds[1] + bounds[3]) * 0.5f;
+  shape->hx = (bounds[2] - bounds[0]) * 0.5f;
+  shape->hy = (bounds[3] - bounds[1]) * 0.5f;
+  if (shape->hx < 0.5f || shape->hy < 0.5f) {
+    return false;
+  }
+
+  // Points lie on the Bezier approximation of the arcs, chords are within the tessellation
+  // tolerance of it.
+  const float tolerance = 0.01f + 0.001f * std::max(shape->hx, shape->hy);
+  const float chordTolerance = 0.3f;
+
+  // The corner radius is where the top edge ends.
+  float radius = shape->hx;
+  for (int i = 0; i < npoints; ++i) {
+    float x, y;
+    point(i, &x, &y);
+    if (y - bounds[1] <= tolerance) {
+      radius = std::min(radius, x - bounds[0]);
+    }
+  }
+
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    shape->ellipse = attempt == 1;
+    shape->radius = std::min(std::max(radius, 0.0f), std::min(shape->hx, shape->hy));
+    bool fits = true;
+    float px, py;
+    point(npoints - 1, &px, &py);
+    for (int i = 0; i < npoints && fits; ++i) {
+      float x, y;
+      point(i, &x, &y);
+      const float d = analyticShapeDistance(*shape, x, y);
+      const float chord = analyticShapeDistance(*shape, (x + px) * 0.5f, (y + py) * 0.5f);
+      fits = fabsf(d) <= tolerance && chord <= tolerance && chord >= -chordTolerance;
+      px = x;
+      py = y;
+    }
+    if (fits) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Twice the signed area of triangle (a, b, c), positive for the winding nanovg gives solid paths,
+// same as nvg__triarea2().
+static float triangleArea2(float ax, float ay, float bx, float by, float cx, float cy) {
+  return (cx - ax) * (by - ay) - (bx - ax) * (cy - ay);
+}
+
+// Whether segments (a, b) and (c, d) intersect or touch.
+static bool segmentsIntersect(const float* a, const float* b, const float* c, const float* d) {
+  const float d1 = triangleArea2(c[0], c[1], d[0], d[1], a[0], a[1]);
+  const float d2 = triangleArea2(c[0], c[1], d[0], d[1], b[0], b[1]);
+  const float d3 = triangleArea2(a[0], a[1], b[0], b[1], c[0], c[1]);
+  const float d4 = triangleArea2(a[0], a[1], b[0], b[1], d[0], d[1]);
+  if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0)) && ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0))) {
+    return true;
+  }
+  auto onSegment = [](const float* p, const float* q, const float* r) {
+    return std::min(p[0], q[0]) <= r[0] && r[0] <= std::max(p[0], q[0]) &&
+           std::min(p[1], q[1]) <= r[1] && r[1] <= std::max(p[1], q[1]);
+  };
+  return (d1 == 0 && onSegment(c, d, a)) || (d2 == 0 && onSegment(c, d, b)) ||
+         (d3 == 0 && onSegment(a, b, c)) || (d4 == 0 && onSegment(a, b, d));
+}
+
+// Whether no two non-adjacent edges of the polygon of `n` points `xy` intersect.
+static bool isSimplePolygon(const float (*xy)[2], int n) {
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 2; j < n; ++j) {
+      if (i == 0 && j == n - 1) {
+        continue;
+      }
+      if (segmentsIntersect(xy[i], xy[i + 1], xy[j], xy[(j + 1) % n])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Ear-clips the simple polygon of `n` points `xy`, with a positive triangleArea2() winding, into
+// `indexes`. Returns the number of indexes, or 0 if no ear is left before the last triangle.
+static int earClipPolygon(const float (*xy)[2], int n, int* indexes) {
+  int prev[kMaxTriangulatedVertices];
+  int next[kMaxTriangulatedVertices];
+  for (int i = 0; i < n; ++i) {
+    prev[i] = (i + n - 1) % n;
+    next[i] = (i + 1) % n;
+  }
+
+  int count = 0;
+  int remaining = n;
+  int i = 0;
+  int misses = 0;
+  while (remaining > 3) {
+    const int p = prev[i];
+    const int q = next[i];
+    const float* a = xy[p];
+    const float* b = xy[i];
+    const float* c = xy[q];
+    const float area = triangleArea2(a[0], a[1], b[0], b[1], c[0], c[1]);
+    bool ear = area > 0;
+    for (int j = next[q]; ear && j != p; j = next[j]) {
+      const float* v = xy[j];
+      ear = !(triangleArea2(a[0], a[1], b[0], b[1], v[0], v[1]) >= 0 &&
+              triangleArea2(b[0], b[1], c[0], c[1], v[0], v[1]) >= 0 &&
+              triangleArea2(c[0], c[1], a[0], a[1], v[0], v[1]) >= 0);
+    }
+    // Collinear points are dropped without a triangle.
+    if (ear || area == 0) {
+      if (ear) {
+        indexes[count++] = p;
+        indexes[count++] = i;
+        indexes[count++] = q;
+      }
+      next[p] = q;
+      prev[q] = p;
+      remaining--;
+      misses = 0;
+      i = q;
+    } else if (++misses > remaining) {
+      return 0;
+    } else {
+      i = q;
+    }
+  }
+  indexes[count++] = prev[i];
+  indexes[count++] = i;
+  indexes[count++] = next[i];
+  return count;
+}
+
+static bool scissorRectEquals(const Call& a, const Call& b) {
+  return memcmp(a.scissorRect, b.scissorRect, sizeof(a.scissorRect)) == 0;
+}
+
 static int MAXINT(int a, int b) {
   return a > b ? a : b;
 }
@@ -305,14 +1384,26 @@ static iglu::simdtypes::float4 preMultiplyColor(NVGcolor c) {
   return ret;
 }
 
-static void transformToMat3x3(iglu::simdtypes::float3x3* m3, float* t) {
-  float columns_0[3] = {t[0], t[1], 0.0f};
-  float columns_1[3] = {t[2], t[3], 0.0f};
-  float columns_2[3] = {t[4], t[5], 1.0f};
+// Stores an affine transform as a column-major 2x2 linear part and a translation, which goes
+// to components `translateIndex` and `translateIndex + 1` of `translate`.
+static void transformToAffine(iglu::simdtypes::float4* linear,
+                              iglu::simdtypes::float4* translate,
+                              int translateIndex,
+                              const float* t) {
+  *linear = iglu::simdtypes::float4{t[0], t[1], t[2], t[3]};
+  (*translate)[translateIndex] = t[4];
+  (*translate)[translateIndex + 1] = t[5];
+}
 
-  memcpy(&m3->columns[0], columns_0, 3 * sizeof(float));
-  memcpy(&m3->columns[1], columns_1, 3 * sizeof(float));
-  memcpy(&m3->columns[2], columns_2, 3 * sizeof(float));
+// Triangulates a convex fill of `nfill` vertices starting at `hubVertOffset` as a fan.
+template<typename T>
+static T* writeFanIndexes(T* index, int hubVertOffset, int nfill) {
+  for (int j = 2; j < nfill; j++) {
+    *index++ = (T)hubVertOffset;
+    *index++ = (T)(hubVertOffset + j - 1);
+    *index++ = (T)(hubVertOffset + j);
+  }
+  return index;
 }
 
 static void setVertextData(NVGvertex* vtx, float x, float y, float u, float v) {
@@ -322,30 +1413,116 @@ static void setVertextData(NVGvertex* vtx, float x, float y, float u, float v) {
   vtx->v = v;
 }
 
+// `positionFactor` is the number of fixed-point steps per unit, positions out of range are
+// clamped.
+static void setCompactVertexData(CompactVertex* vtx,
+                                 float x,
+                                 float y,
+                                 float u,
+                                 float v,
+                                 float positionFactor) {
+  vtx->x = (int16_t)std::clamp(lrintf(x * positionFactor), -32767L, 32767L);
+  vtx->y = (int16_t)std::clamp(lrintf(y * positionFactor), -32767L, 32767L);
+  vtx->u = (uint16_t)(std::clamp(u, 0.0f, 1.0f) * 65535.0f + 0.5f);
+  vtx->v = (uint16_t)(std::clamp(v, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
 class Context {
  public:
+  // Declared first, the containers below allocate through it.
+  const Allocator allocator_;
   igl::IDevice* device_ = nullptr;
   igl::IRenderCommandEncoder* renderEncoder_ = nullptr;
 
   size_t fragmentUniformBufferSize_;
   size_t maxUniformBufferSize_;
-  int indexSize_;
+  size_t uniformBufferAlignment_;
+  int vertexSize_;
+  float compactPositionFactor_;
+  // Paint uniforms are pushed per draw instead of bound from a uniform buffer, Vulkan only.
+  bool pushConstants_ = false;
+  // Paint uniforms are read from a storage buffer at the base instance of the draw.
+  bool paintTable_ = false;
+  // Text is drawn as GlyphInstance records, see NVG_GLYPH_INSTANCES.
+  bool glyphInstances_ = false;
+  // Runs of non-overlapping fills are drawn with multi-draw indirect, see multiDrawFill().
+  bool multiDrawFills_ = false;
+  // Runs of non-overlapping fills share their stencil and cover draws, see batchFill().
+  bool batchFills_ = false;
+  // Calls record their bounds, for NVG_SORT_CALLS, multiDrawFills_, rollingStencilRefs_ and
+  // batchFills_.
+  bool callBounds_ = false;
+  // Stencil strokes leave their reference in the stencil instead of clearing it, see
+  // allocStencilClear(). `stencilRef_` is the last reference since the stencil was zero, and
+  // `stencilDirtyBounds_` the bounds of the strokes that wrote it.
+  bool rollingStencilRefs_ = false;
+  uint32_t stencilRef_ = 0;
+  float stencilDirtyBounds_[4];
+  // Axis-aligned scissors clip with the encoder's scissor rect and fully clipped calls are
+  // dropped, see NVG_SCISSOR_RECTS.
+  bool scissorRects_ = false;
+  // Concave paths with at most this many points are triangulated, see renderTriangulatedFill().
+  int triangulateMaxVertices_ = 0;
+  uint32_t paintInstance_ = 0;
   int flags_;
   igl_vector_uint2 viewPortSize_;
 
   igl::IFramebuffer* framebuffer_ = nullptr;
+  std::shared_ptr<igl::ICommandBuffer> commandBuffer_;
 
   // Textures
-  std::vector<std::shared_ptr<Texture>> textures_;
+  Vector<std::shared_ptr<Texture>> textures_;
   int textureId_;
 
   // Per frame buffers
   std::shared_ptr<Buffers> curBuffers_ = nullptr;
-  std::vector<std::shared_ptr<Buffers>> allBuffers_;
-  int maxBuffers_;
+  Vector<std::shared_ptr<Buffers>> allBuffers_;
+  Vector<std::shared_ptr<Buffers>> freeBuffers_;
+  // Circular queue of maxFramesInFlight_ submissions, reused so that frames do not allocate. It
+  // only grows while a submission that may still be recorded is not retired, see allocBuffers().
+  Vector<Submission> submissions_;
+  size_t firstSubmission_ = 0;
+  size_t numSubmissions_ = 0;
+  int maxFramesInFlight_;
+  uint64_t frameIndex_ = 0;
+  iglu::simdtypes::float4x4 vertexMatrix_ = iglu::simdtypes::float4x4(1.0f);
+
+  // Capacity management
+  FrameUsage usageHint_;
+  FrameUsage usageHistory_[kUsageHistoryFrames];
+  int usageHistoryIndex_ = 0;
+
+  // Long-lived buffers shared by all frames, only used with NVG_RING_BUFFERS.
+  std::shared_ptr<RingBuffer> vertexRing_;
+  std::shared_ptr<RingBuffer> indexRing_;
+  std::shared_ptr<RingBuffer> uniformRing_;
+  // Frames write vertices and indexes straight into the vertex and index rings. Not on OpenGL,
+  // where IGL maps buffers for reading only.
+  bool mappedRings_ = false;
+
+  // States bound on renderEncoder_ since the start of renderFlush(), so that binds which would
+  // not change anything are skipped. Null means unknown.
+  struct EncoderState {
+    igl::IRenderPipelineState* pipeline = nullptr;
+    igl::IDepthStencilState* depthStencil = nullptr;
+    igl::IBuffer* vertexBuffer = nullptr;
+    size_t vertexBufferOffset = 0;
+    igl::IBuffer* indexBuffer = nullptr;
+    size_t indexBufferOffset = 0;
+    igl::IBuffer* vertexUniformBuffer = nullptr;
+    igl::IBuffer* fragmentBuffer = nullptr;
+    size_t fragmentBufferOffset = 0;
+    igl::ITexture* texture = nullptr;
+    igl::ISamplerState* sampler = nullptr;
+    uint32_t stencilReference = 0;
+    bool scissor = false;
+    igl::ScissorRect scissorRect;
+  };
+  EncoderState encoderState_;
+
+  RenderStats stats_;
 
   // Cached states.
-  Blend* blendFunc_ = nullptr;
   std::shared_ptr<igl::IDepthStencilState> defaultStencilState_;
   std::shared_ptr<igl::IDepthStencilState> fillShapeStencilState_;
   std::shared_ptr<igl::IDepthStencilState> fillAntiAliasStencilState_;
@@ -353,18 +1530,40 @@ class Context {
   std::shared_ptr<igl::IDepthStencilState> strokeShapeStencilState_;
   std::shared_ptr<igl::IDepthStencilState> strokeAntiAliasStencilState_;
   std::shared_ptr<igl::IDepthStencilState> strokeClearStencilState_;
+  std::shared_ptr<igl::IDepthStencilState> strokeShapeRollingStencilState_;
+  std::shared_ptr<igl::IDepthStencilState> strokeAntiAliasRollingStencilState_;
   std::shared_ptr<igl::IShaderModule> fragmentFunction_;
   std::shared_ptr<igl::IShaderModule> vertexFunction_;
-  igl::TextureFormat piplelinePixelFormat_;
+  std::shared_ptr<igl::IShaderStages> shaderStages_;
+  std::shared_ptr<igl::IShaderStages> stencilOnlyShaderStages_;
+  std::shared_ptr<igl::IVertexInputState> vertexInputState_;
+  std::shared_ptr<igl::IShaderStages> glyphShaderStages_;
+  std::shared_ptr<igl::IVertexInputState> glyphVertexInputState_;
+  // Every pipeline created by the context, they are never destroyed before the context.
+  // Guarded by pipelineCacheMutex_ together with stats_.createdPipelines, because
+  // prewarmThread_ adds to it.
+  Vector<PipelineCacheEntry> pipelineCache_;
+  std::mutex pipelineCacheMutex_;
+  std::thread prewarmThread_;
+  bool prewarmed_ = false;
+  // Key of pipelineState_, the other pipelines of the blend differ by topology and write mask.
+  PipelineKey pipelineKey_;
   std::shared_ptr<igl::IRenderPipelineState> pipelineState_;
   std::shared_ptr<igl::IRenderPipelineState> pipelineStateTriangleStrip_;
   std::shared_ptr<igl::IRenderPipelineState> stencilOnlyPipelineState_;
   std::shared_ptr<igl::IRenderPipelineState> stencilOnlyPipelineStateTriangleStrip_;
+  std::shared_ptr<igl::IRenderPipelineState> glyphPipelineState_;
   std::shared_ptr<igl::ISamplerState> pseudoSampler_;
   std::shared_ptr<igl::ITexture> pseudoTexture_;
   igl::VertexInputStateDesc vertexDescriptor_;
 
-  Context() {
+  explicit Context(const Allocator& allocator) :
+    allocator_(allocator),
+    textures_(StlAllocator<std::shared_ptr<Texture>>(&allocator_)),
+    allBuffers_(StlAllocator<std::shared_ptr<Buffers>>(&allocator_)),
+    freeBuffers_(StlAllocator<std::shared_ptr<Buffers>>(&allocator_)),
+    submissions_(StlAllocator<Submission>(&allocator_)),
+    pipelineCache_(StlAllocator<PipelineCacheEntry>(&allocator_)) {
     IGL_LOG_DEBUG("iglu::nanovg::Context::Context()\n");
   }
 
@@ -372,15 +1571,257 @@ class Context {
     IGL_LOG_DEBUG("iglu::nanovg::Context::~Context()\n");
   }
 
+  std::shared_ptr<Buffers> allocBuffers() {
+    // Keeps at most maxFramesInFlight_ submissions in flight, including the one being encoded.
+    // Waiting for a command buffer that is still recorded would never return, the frame gets
+    // another set instead.
+    while (numSubmissions_ >= (size_t)maxFramesInFlight_ && !mayBeRecorded(submissionAt(0))) {
+      retireSubmission();
+    }
+
+    std::shared_ptr<Buffers> buffers;
+    if (freeBuffers_.empty()) {
+      buffers = newBuffers();
+      allBuffers_.emplace_back(buffers);
+    } else {
+      buffers = freeBuffers_.back();
+      freeBuffers_.pop_back();
+    }
+    reserveBuffers(*buffers);
+    if (mappedRings_) {
+      buffers->reserveRingRegions(frameIndex_);
+    }
+    return buffers;
+  }
+
+  std::shared_ptr<Buffers> newBuffers() {
+    std::shared_ptr<Buffers> buffers = makeShared<Buffers>(&allocator_,
+                                                           device_,
+                                                           kMinUniformBlockSize,
+                                                           maxUniformBufferSize_,
+                                                           fragmentUniformBufferSize_,
+                                                           vertexSize_,
+                                                           flags_ & NVG_RING_BUFFERS,
+                                                           pushConstants_ || paintTable_,
+                                                           &allocator_,
+                                                           &stats_);
+    if (mappedRings_) {
+      buffers->mappedVertexRing = vertexRing_.get();
+      buffers->mappedIndexRing = indexRing_.get();
+    }
+    return buffers;
+  }
+
+  FrameUsage expectedUsage() const {
+    FrameUsage usage = usageHint_;
+    for (const FrameUsage& frame : usageHistory_) {
+      usage.calls = MAXINT(usage.calls, frame.calls);
+      usage.verts = MAXINT(usage.verts, frame.verts);
+      usage.indexes = MAXINT(usage.indexes, frame.indexes);
+      usage.uniformBytes = std::max(usage.uniformBytes, frame.uniformBytes);
+    }
+    return usage;
+  }
+
+  void recordUsage(const Buffers& buffers) {
+    FrameUsage& usage = usageHistory_[usageHistoryIndex_];
+    usage.calls = buffers.ncalls;
+    usage.verts = buffers.nverts;
+    usage.indexes = buffers.nindexes;
+    usage.uniformBytes = buffers.uniformBufferPool->usedSize();
+    usageHistoryIndex_ = (usageHistoryIndex_ + 1) % kUsageHistoryFrames;
+  }
+
+  // Sizes the buffers for the high-water mark of the last kUsageHistoryFrames frames before a
+  // frame starts, so steady-state frames never grow. Capacities left over from a spike decay
+  // once the spike drops out of the history.
+  void reserveBuffers(Buffers& buffers) {
+    const FrameUsage usage = expectedUsage();
+
+    int ccalls = MAXINT(usage.calls + usage.calls / 8, kMinCallCapacity);
+    if (buffers.ccalls >= ccalls && buffers.ccalls <= 2 * ccalls) {
+      ccalls = buffers.ccalls;
+    }
+
+    int cverts = MAXINT(usage.verts + usage.verts / 8, kMinVertexCapacity);
+    if (buffers.cverts >= cverts && buffers.cverts <= 2 * cverts) {
+      cverts = buffers.cverts;
+    }
+
+    buffers.indexSize = usage.verts > kMaxUInt16Vertices ? sizeof(uint32_t) : sizeof(uint16_t);
+    int cindexes = MAXINT(usage.indexes + usage.indexes / 8, kMinIndexCapacity);
+    if (buffers.cindexes >= cindexes && buffers.cindexes <= 2 * cindexes) {
+      cindexes = buffers.cindexes;
+    }
+
+    const bool vertsResized = cverts != buffers.cverts;
+    const bool indexesResized =
+        cindexes != buffers.cindexes ||
+        (buffers.indexBuffer && !(flags_ & NVG_RING_BUFFERS) &&
+         buffers.indexBuffer->getSizeInBytes() < (size_t)buffers.indexSize * cindexes);
+    buffers.resizeArena(ccalls, cverts, cindexes, &stats_);
+    if (vertsResized) {
+      createVertexBuffer(buffers);
+    }
+    if (indexesResized) {
+      createIndexBuffer(buffers);
+    }
+
+    // Up to two uniform blocks per call, at most half of the slots are used.
+    size_t nslots = 16;
+    while (nslots < (size_t)ccalls * 4) {
+      nslots *= 2;
+    }
+    if (buffers.uniformSlots.size() < nslots || buffers.uniformSlots.size() > 4 * nslots) {
+      resizeUniformSlots(buffers, nslots);
+    }
+
+    const size_t uniformBytes = usage.uniformBytes + usage.uniformBytes / 8;
+    buffers.uniformBufferPool->shrink(uniformBytes);
+    buffers.uniformBufferPool->reserve(uniformBytes);
+  }
+
+  // The GPU buffers are created for the arena capacities, the data is uploaded at flush.
+  void createVertexBuffer(Buffers& buffers) {
+    if (!(flags_ & NVG_RING_BUFFERS)) {
+      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Vertex,
+                           nullptr,
+                           vertexSize_ * buffers.cverts,
+                           igl::ResourceStorage::Shared);
+      desc.debugName = "vertex_buffer";
+      buffers.vertBuffer = createBuffer(device_, desc, &stats_);
+    }
+  }
+
+  void createIndexBuffer(Buffers& buffers) {
+    if (!(flags_ & NVG_RING_BUFFERS)) {
+      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Index,
+                           nullptr,
+                           buffers.indexSize * buffers.cindexes,
+                           igl::ResourceStorage::Shared);
+      desc.debugName = "index_buffer";
+      buffers.indexBuffer = createBuffer(device_, desc, &stats_);
+    }
+  }
+
+  // Converts the indexes written so far to 32 bits, once a frame outgrows 16-bit indexes.
+  void widenIndexes(Buffers& buffers) {
+    const unsigned char* src = buffers.indexes;
+    unsigned char* dst = buffers.indexes;
+    // A ring region only fits 16-bit indexes, they are converted into a larger one. Keeps the
+    // buffer of the old region alive while it is read.
+    const std::shared_ptr<igl::IBuffer> previous = buffers.indexBuffer;
+    if (buffers.mappedIndexRing != nullptr) {
+      dst = buffers.reserveRingRegion(*buffers.mappedIndexRing,
+                                      sizeof(uint32_t) * buffers.cindexes,
+                                      nullptr,
+                                      0,
+                                      &buffers.indexBuffer,
+                                      &buffers.indexBufferOffset);
+      buffers.indexes = dst;
+    }
+    // Backwards, so that no 16-bit index is overwritten before it is read.
+    for (int i = buffers.nindexes; i--;) {
+      uint16_t index16;
+      memcpy(&index16, src + i * sizeof(uint16_t), sizeof(uint16_t));
+      const uint32_t index32 = index16;
+      memcpy(dst + i * sizeof(uint32_t), &index32, sizeof(uint32_t));
+    }
+    buffers.indexSize = sizeof(uint32_t);
+    createIndexBuffer(buffers);
+    stats_.frameGrowths++;
+  }
+
+  Submission& submissionAt(size_t i) {
+    return submissions_[(firstSubmission_ + i) % submissions_.size()];
+  }
+
+  // The paint table holds the whole uniform pool, it is recreated when the pool outgrows it.
+  size_t uploadPaintTable(Buffers& buffers) {
+    UniformBufferPool& pool = *buffers.uniformBufferPool;
+    if (buffers.paintTableBuffer == nullptr ||
+        buffers.paintTableBuffer->getSizeInBytes() < pool.usedSize()) {
+      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Storage,
+                           nullptr,
+                           pool.capacity(),
+                           igl::ResourceStorage::Shared);
+      desc.debugName = "paint_table_buffer";
+      buffers.paintTableBuffer = createBuffer(device_, desc, &stats_);
+    }
+    return pool.uploadToBuffer(buffers.paintTableBuffer.get(), 0);
+  }
+
+  // Whether the application may still encode into the command buffer of `submission`, which IGL
+  // cannot tell: when it is set for the current frame, or when the latest frame was encoded into
+  // it too, e.g. while command buffers are recorded in turns. OpenGL is never waited for.
+  bool mayBeRecorded(const Submission& submission) {
+    const igl::ICommandBuffer* commandBuffer = submission.commandBuffer.get();
+    return commandBuffer != nullptr && device_->getBackendType() != igl::BackendType::OpenGL &&
+           (commandBuffer == commandBuffer_.get() ||
+            commandBuffer == submissionAt(numSubmissions_ - 1).commandBuffer.get());
+  }
+
+  void retireSubmission() {
+    Submission& submission = submissionAt(0);
+    // See mayBeRecorded(). OpenGL synchronizes buffer updates itself.
+    if (submission.commandBuffer && device_->getBackendType() != igl::BackendType::OpenGL) {
+      submission.commandBuffer->waitUntilCompleted();
+      stats_.gpuWaits++;
+    }
+
+    if (flags_ & NVG_RING_BUFFERS) {
+      vertexRing_->retire(submission.lastFrame);
+      indexRing_->retire(submission.lastFrame);
+      if (uniformRing_) {
+        uniformRing_->retire(submission.lastFrame);
+      }
+    }
+
+    for (auto& buffers : submission.buffers) {
+      freeBuffers_.emplace_back(std::move(buffers));
+    }
+    submission.buffers.clear();
+    submission.commandBuffer = nullptr;
+    firstSubmission_ = (firstSubmission_ + 1) % submissions_.size();
+    numSubmissions_--;
+  }
+
+  void submitBuffers() {
+    // Frames encoded into the same command buffer share one submission, the buffers of all of
+    // them are released together when it completes.
+    if (commandBuffer_ == nullptr || numSubmissions_ == 0 ||
+        submissionAt(numSubmissions_ - 1).commandBuffer != commandBuffer_) {
+      if (numSubmissions_ == submissions_.size()) {
+        // allocBuffers() could not retire a submission that may still be recorded.
+        std::rotate(submissions_.begin(),
+                    submissions_.begin() + firstSubmission_,
+                    submissions_.end());
+        firstSubmission_ = 0;
+        submissions_.emplace_back(&allocator_);
+      }
+      numSubmissions_++;
+      submissionAt(numSubmissions_ - 1).commandBuffer = std::move(commandBuffer_);
+    }
+    Submission& submission = submissionAt(numSubmissions_ - 1);
+    submission.buffers.emplace_back(std::move(curBuffers_));
+    submission.lastFrame = frameIndex_;
+    commandBuffer_ = nullptr;
+  }
+
   Call* allocCall() {
     Call* ret = NULL;
     if (curBuffers_->ncalls + 1 > curBuffers_->ccalls) {
-      int ccalls = MAXINT(curBuffers_->ncalls + 1, 128) + curBuffers_->ccalls / 2;
-      curBuffers_->calls.resize(ccalls);
-      curBuffers_->ccalls = ccalls;
+      int ccalls = MAXINT(curBuffers_->ncalls + 1, kMinCallCapacity) + curBuffers_->ccalls / 2;
+      curBuffers_->resizeArena(ccalls, curBuffers_->cverts, curBuffers_->cindexes, &stats_);
+      stats_.frameGrowths++;
     }
     ret = &curBuffers_->calls[curBuffers_->ncalls++];
-    memset(ret, 0, sizeof(Call));
+    // The arena is not cleared. Renderers set the fields that they draw with, these are the ones
+    // that every call is read for.
+    ret->multiDrawCount = 0;
+    ret->clearsStencil = false;
+    ret->fillBatchCount = 0;
+    std::fill_n(ret->scissorRect, 4, 0);
     return ret;
   }
 
@@ -388,21 +1829,60 @@ class Context {
     return curBuffers_->uniformBufferPool->allocData(dataSize);
   }
 
+  // Rebuilds the slot table with `nslots` slots, a power of two, keeping the live slots.
+  void resizeUniformSlots(Buffers& buffers, size_t nslots) {
+    Vector<UniformSlot> slots(nslots, UniformSlot(), StlAllocator<UniformSlot>(&allocator_));
+    stats_.heapAllocations++;
+    for (const UniformSlot& slot : buffers.uniformSlots) {
+      if (slot.generation == buffers.uniformGeneration) {
+        size_t i = slot.hash & (nslots - 1);
+        while (slots[i].generation == buffers.uniformGeneration) {
+          i = (i + 1) & (nslots - 1);
+        }
+        slots[i] = slot;
+      }
+    }
+    buffers.uniformSlots = std::move(slots);
+  }
+
+  // Returns the uniform block holding `frag`. Identical blocks written earlier in the frame are
+  // shared, so that repeated paints take one slot and upload once.
+  UniformBufferIndex internFragUniforms(const FragmentUniforms& frag) {
+    Buffers& buffers = *curBuffers_;
+    if ((size_t)(buffers.nuniformSlots + 1) * 2 > buffers.uniformSlots.size()) {
+      resizeUniformSlots(buffers, std::max(buffers.uniformSlots.size() * 2, (size_t)16));
+      stats_.frameGrowths++;
+    }
+
+    const uint64_t hash = hashFragUniforms(frag);
+    const size_t mask = buffers.uniformSlots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      UniformSlot& slot = buffers.uniformSlots[i];
+      if (slot.generation != buffers.uniformGeneration) {
+        slot.hash = hash;
+        slot.generation = buffers.uniformGeneration;
+        slot.index = allocFragUniforms(fragmentUniformBufferSize_);
+        memcpy(slot.index.data, &frag, sizeof(FragmentUniforms));
+        buffers.nuniformSlots++;
+        return slot.index;
+      }
+      if (slot.hash == hash && memcmp(slot.index.data, &frag, sizeof(FragmentUniforms)) == 0) {
+        stats_.sharedUniformBlocks++;
+        return slot.index;
+      }
+    }
+  }
+
   int allocIndexes(int n) {
     int ret = 0;
+    // Keeps the index buffer offset of every call 4-byte aligned.
+    curBuffers_->nindexes = (curBuffers_->nindexes + 1) & ~1;
     if (curBuffers_->nindexes + n > curBuffers_->cindexes) {
-      int cindexes = MAXINT(curBuffers_->nindexes + n, 4096) + curBuffers_->cindexes / 2;
-      curBuffers_->indexes.resize(cindexes);
-
-      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Index,
-                           curBuffers_->indexes.data(),
-                           indexSize_ * cindexes,
-                           igl::ResourceStorage::Shared);
-      desc.debugName = "index_buffer";
-      std::shared_ptr<igl::IBuffer> buffer = device_->createBuffer(desc, NULL);
-
-      curBuffers_->indexBuffer = buffer;
-      curBuffers_->cindexes = cindexes;
+      int cindexes =
+          MAXINT(curBuffers_->nindexes + n, kMinIndexCapacity) + curBuffers_->cindexes / 2;
+      curBuffers_->resizeArena(curBuffers_->ccalls, curBuffers_->cverts, cindexes, &stats_);
+      createIndexBuffer(*curBuffers_);
+      stats_.frameGrowths++;
     }
     ret = curBuffers_->nindexes;
     curBuffers_->nindexes += n;
@@ -419,34 +1899,114 @@ class Context {
       }
     }
     if (tex == nullptr) {
-      tex = std::make_shared<Texture>();
+      tex = makeShared<Texture>(&allocator_);
       textures_.emplace_back(tex);
     }
     tex->Id = ++textureId_;
     return tex;
   }
 
+  // Allocates a quad over the strokes that left their rolling stencil reference since the stencil
+  // was last zero, drawn with strokeClearStencilState_ before `call`, or after the last call of
+  // the frame for a null `call`. The bounds of `call` grow by the quad, so that NVG_SORT_CALLS
+  // does not move the strokes it clears across it. Does nothing when the stencil is zero.
+  void allocStencilClear(Call* call) {
+    if (stencilRef_ == 0) {
+      return;
+    }
+    const int offset = allocVerts(4);
+    const float* b = stencilDirtyBounds_;
+    writeVert(offset + 0, b[2], b[3], 0.5f, 1.0f);
+    writeVert(offset + 1, b[2], b[1], 0.5f, 1.0f);
+    writeVert(offset + 2, b[0], b[3], 0.5f, 1.0f);
+    writeVert(offset + 3, b[0], b[1], 0.5f, 1.0f);
+    stencilRef_ = 0;
+    if (call == nullptr) {
+      curBuffers_->stencilClearOffset = offset;
+      return;
+    }
+    call->clearsStencil = true;
+    call->stencilClearOffset = offset;
+    call->bounds[0] = std::min(call->bounds[0], b[0]);
+    call->bounds[1] = std::min(call->bounds[1], b[1]);
+    call->bounds[2] = std::max(call->bounds[2], b[2]);
+    call->bounds[3] = std::max(call->bounds[3], b[3]);
+  }
+
   int allocVerts(int n) {
     int ret = 0;
     if (curBuffers_->nverts + n > curBuffers_->cverts) {
-      int cverts = MAXINT(curBuffers_->nverts + n, 4096) + curBuffers_->cverts / 2;
-      curBuffers_->verts.resize(cverts);
-
-      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Vertex,
-                           curBuffers_->verts.data(),
-                           sizeof(NVGvertex) * cverts,
-                           igl::ResourceStorage::Shared);
-      desc.debugName = "vertex_buffer";
-      std::shared_ptr<igl::IBuffer> buffer = device_->createBuffer(desc, NULL);
-
-      curBuffers_->vertBuffer = buffer;
-      curBuffers_->cverts = cverts;
+      int cverts = MAXINT(curBuffers_->nverts + n, kMinVertexCapacity) + curBuffers_->cverts / 2;
+      curBuffers_->resizeArena(curBuffers_->ccalls, cverts, curBuffers_->cindexes, &stats_);
+      createVertexBuffer(*curBuffers_);
+      stats_.frameGrowths++;
+    }
+    if (curBuffers_->indexSize == sizeof(uint16_t) &&
+        curBuffers_->nverts + n > kMaxUInt16Vertices) {
+      widenIndexes(*curBuffers_);
     }
     ret = curBuffers_->nverts;
     curBuffers_->nverts += n;
     return ret;
   }
 
+  // Copies vertices into the current buffers at `offset`, converting them to the vertex layout.
+  void writeVerts(int offset, const NVGvertex* verts, int n) {
+    unsigned char* dst = curBuffers_->verts + offset * vertexSize_;
+    if (!(flags_ & NVG_COMPACT_VERTICES)) {
+      memcpy(dst, verts, sizeof(NVGvertex) * n);
+      return;
+    }
+    CompactVertex* vtx = (CompactVertex*)dst;
+    for (int i = 0; i < n; ++i) {
+      setCompactVertexData(
+          &vtx[i], verts[i].x, verts[i].y, verts[i].u, verts[i].v, compactPositionFactor_);
+    }
+  }
+
+  // Writes the glyphs of `verts`, 6 vertices each, as GlyphInstance records in the vertex slots
+  // of `call`. Returns false without writing if any glyph is not an axis-aligned quad.
+  bool writeGlyphs(Call* call, const NVGvertex* verts, int nglyphs) {
+    const int offset = curBuffers_->nverts;
+    const int slots = (int)((nglyphs * sizeof(GlyphInstance) + vertexSize_ - 1) / vertexSize_);
+    allocVerts(slots);
+    GlyphInstance* glyphs = (GlyphInstance*)(curBuffers_->verts + offset * vertexSize_);
+    for (int i = 0; i < nglyphs; ++i) {
+      if (!setGlyphInstanceData(&glyphs[i], &verts[i * 6])) {
+        curBuffers_->nverts = offset;
+        return false;
+      }
+    }
+    call->triangleOffset = offset;
+    call->triangleCount = nglyphs;
+    stats_.instancedGlyphs += nglyphs;
+    return true;
+  }
+
+  void writeVert(int offset, float x, float y, float u, float v) {
+    unsigned char* dst = curBuffers_->verts + offset * vertexSize_;
+    if (flags_ & NVG_COMPACT_VERTICES) {
+      setCompactVertexData((CompactVertex*)dst, x, y, u, v, compactPositionFactor_);
+    } else {
+      setVertextData((NVGvertex*)dst, x, y, u, v);
+    }
+  }
+
+  // Writes the stroke vertices of `paths` at `offset` as one triangle strip, repeating the first
+  // and last vertex of every path to separate them. Returns the offset after the last vertex.
+  int writeStrokeVerts(int offset, const NVGpath* paths, int npaths) {
+    const NVGpath* path = paths;
+    for (int i = npaths; i--; ++path) {
+      if (path->nstroke > 0) {
+        writeVerts(offset, path->stroke, 1);
+        writeVerts(offset + 1, path->stroke, path->nstroke);
+        writeVerts(offset + 1 + path->nstroke, path->stroke + path->nstroke - 1, 1);
+        offset += path->nstroke + 2;
+      }
+    }
+    return offset;
+  }
+
   Blend blendCompositeOperation(NVGcompositeOperationState op) {
     Blend blend;
     if (!convertBlendFuncFactor(op.srcRGB, &blend.srcRGB) ||
@@ -461,6 +2021,79 @@ class Context {
     return blend;
   }
 
+  // Computes the framebuffer rect that clips like the scissor mask of the shaders would, into
+  // `rect`. That is the case for a scissor without rotation or skew whose edges fall between
+  // pixels when a fringe is one pixel: the mask is then either 0 or 1 at pixel centers.
+  // Returns false, without touching `rect`, otherwise or without NVG_SCISSOR_RECTS.
+  bool hardwareScissor(const NVGscissor* scissor, float fringe, int* rect) const {
+    if (!scissorRects_ || scissor->extent[0] < -0.5f || scissor->extent[1] < -0.5f ||
+        scissor->xform[1] != 0.0f || scissor->xform[2] != 0.0f) {
+      return false;
+    }
+    // The matrix of SetRenderCommandEncoder() may rotate the view, e.g. for Vulkan pre-rotation.
+    const iglu::simdtypes::float4x4 identity(1.0f);
+    const VertexUniforms& vertexUniforms = curBuffers_->vertexUniforms;
+    if (memcmp(&vertexUniforms.matrix, &identity, sizeof(identity)) != 0) {
+      return false;
+    }
+    const float sx = viewPortSize_.x / vertexUniforms.viewSize[0];
+    const float sy = viewPortSize_.y / vertexUniforms.viewSize[1];
+    if (fabsf(sx * fringe - 1.0f) > 1e-3f || fabsf(sy * fringe - 1.0f) > 1e-3f) {
+      return false;
+    }
+
+    const float hx = scissor->extent[0] * fabsf(scissor->xform[0]);
+    const float hy = scissor->extent[1] * fabsf(scissor->xform[3]);
+    const float edges[4] = {(scissor->xform[4] - hx) * sx,
+                            (scissor->xform[5] - hy) * sy,
+                            (scissor->xform[4] + hx) * sx,
+                            (scissor->xform[5] + hy) * sy};
+    int pixels[4];
+    for (int i = 0; i < 4; ++i) {
+      const float edge = roundf(edges[i]);
+      if (fabsf(edges[i] - edge) > 1e-3f) {
+        return false;
+      }
+      const float size = (float)(i & 1 ? viewPortSize_.y : viewPortSize_.x);
+      pixels[i] = (int)std::clamp(edge, 0.0f, size);
+    }
+    if (pixels[2] <= pixels[0] || pixels[3] <= pixels[1]) {
+      return false;
+    }
+
+    rect[0] = pixels[0];
+    // OpenGL scissor rects start at the bottom of the framebuffer.
+    rect[1] = device_->getBackendType() == igl::BackendType::OpenGL
+                  ? (int)viewPortSize_.y - pixels[3]
+                  : pixels[1];
+    rect[2] = pixels[2] - pixels[0];
+    rect[3] = pixels[3] - pixels[1];
+    return true;
+  }
+
+  // Whether a call within `bounds` is clipped entirely by `scissor`, with NVG_SCISSOR_RECTS.
+  // Scissors of zero area clip everything.
+  bool scissorRejects(const NVGscissor* scissor, const float* bounds, float fringe) {
+    if (!scissorRects_ || scissor->extent[0] < -0.5f || scissor->extent[1] < -0.5f) {
+      return false;
+    }
+    bool rejected = scissor->extent[0] <= 0.0f || scissor->extent[1] <= 0.0f;
+    if (!rejected) {
+      // Bounds of the scissor rect in view units, the mask fades out over half a fringe.
+      const float* xform = scissor->xform;
+      const float hx =
+          scissor->extent[0] * fabsf(xform[0]) + scissor->extent[1] * fabsf(xform[2]) + fringe;
+      const float hy =
+          scissor->extent[0] * fabsf(xform[1]) + scissor->extent[1] * fabsf(xform[3]) + fringe;
+      rejected = bounds[0] > xform[4] + hx || bounds[2] < xform[4] - hx ||
+                 bounds[1] > xform[5] + hy || bounds[3] < xform[5] - hy;
+    }
+    if (rejected) {
+      stats_.rejectedCalls++;
+    }
+    return rejected;
+  }
+
   int convertPaintForFrag(FragmentUniforms* frag,
                           NVGpaint* paint,
                           NVGscissor* scissor,
@@ -475,15 +2108,17 @@ class Context {
     frag->innerCol = preMultiplyColor(paint->innerColor);
     frag->outerCol = preMultiplyColor(paint->outerColor);
 
-    if (scissor->extent[0] < -0.5f || scissor->extent[1] < -0.5f) {
-      frag->scissorMat = iglu::simdtypes::float3x3(0);
-      frag->scissorExt[0] = 1.0f;
-      frag->scissorExt[1] = 1.0f;
+    int scissorRect[4];
+    if (scissor->extent[0] < -0.5f || scissor->extent[1] < -0.5f ||
+        hardwareScissor(scissor, fringe, scissorRect)) {
+      // Negative extents skip the scissor mask in the shaders.
+      frag->scissorExt[0] = -1.0f;
+      frag->scissorExt[1] = -1.0f;
       frag->scissorScale[0] = 1.0f;
       frag->scissorScale[1] = 1.0f;
     } else {
       nvgTransformInverse(invxform, scissor->xform);
-      transformToMat3x3(&frag->scissorMat, invxform);
+      transformToAffine(&frag->scissorMat, &frag->translate, 0, invxform);
       frag->scissorExt[0] = scissor->extent[0];
       frag->scissorExt[1] = scissor->extent[1];
       frag->scissorScale[0] =
@@ -527,63 +2162,393 @@ class Context {
       nvgTransformInverse(invxform, paint->xform);
     }
 
-    transformToMat3x3(&frag->paintMat, invxform);
+    transformToAffine(&frag->paintMat, &frag->translate, 2, invxform);
 
     return 1;
   }
 
+  // The bind*State() functions below skip binds of what is already bound on renderEncoder_.
+  void bindPipelineState(const std::shared_ptr<igl::IRenderPipelineState>& pipelineState) {
+    if (encoderState_.pipeline == pipelineState.get()) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindRenderPipelineState(pipelineState);
+    encoderState_.pipeline = pipelineState.get();
+  }
+
+  void bindDepthStencilState(const std::shared_ptr<igl::IDepthStencilState>& depthStencilState) {
+    if (encoderState_.depthStencil == depthStencilState.get()) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindDepthStencilState(depthStencilState);
+    encoderState_.depthStencil = depthStencilState.get();
+  }
+
+  // Clips to the scissor rect of a call, or to the whole framebuffer for a null `rect` or zero
+  // width. The encoder's scissor is left alone until a call needs one.
+  void bindScissorRectState(const int* rect) {
+    const bool clips = rect != nullptr && rect[2] > 0;
+    if (!clips && !encoderState_.scissor) {
+      return;
+    }
+    igl::ScissorRect scissorRect;
+    if (clips) {
+      scissorRect = {(uint32_t)rect[0], (uint32_t)rect[1], (uint32_t)rect[2], (uint32_t)rect[3]};
+    } else {
+      scissorRect = {0, 0, viewPortSize_.x, viewPortSize_.y};
+    }
+    if (encoderState_.scissor && encoderState_.scissorRect.x == scissorRect.x &&
+        encoderState_.scissorRect.y == scissorRect.y &&
+        encoderState_.scissorRect.width == scissorRect.width &&
+        encoderState_.scissorRect.height == scissorRect.height) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindScissorRect(scissorRect);
+    encoderState_.scissor = true;
+    encoderState_.scissorRect = scissorRect;
+  }
+
+  void bindStencilReferenceState(uint32_t value) {
+    if (encoderState_.stencilReference == value) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->setStencilReferenceValue(value);
+    encoderState_.stencilReference = value;
+  }
+
+  // `offset` is relative to the frame's vertices, glyph draws bind their instances with it.
+  void bindVertexBufferState(size_t offset = 0) {
+    igl::IBuffer* buffer = curBuffers_->vertBuffer.get();
+    if (buffer == nullptr) {
+      return;
+    }
+    offset += curBuffers_->vertBufferOffset;
+    if (encoderState_.vertexBuffer == buffer && encoderState_.vertexBufferOffset == offset) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindVertexBuffer(kVertexInputIndex, *buffer, offset);
+    encoderState_.vertexBuffer = buffer;
+    encoderState_.vertexBufferOffset = offset;
+  }
+
+  // The whole index range of the frame stays bound, draws select their indexes with firstIndex.
+  void bindIndexBufferState() {
+    igl::IBuffer* buffer = curBuffers_->indexBuffer.get();
+    if (encoderState_.indexBuffer == buffer &&
+        encoderState_.indexBufferOffset == curBuffers_->indexBufferOffset) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindIndexBuffer(
+        *buffer, curBuffers_->indexFormat(), curBuffers_->indexBufferOffset);
+    encoderState_.indexBuffer = buffer;
+    encoderState_.indexBufferOffset = curBuffers_->indexBufferOffset;
+  }
+
+  void bindVertexUniformBufferState() {
+    igl::IBuffer* buffer = curBuffers_->vertexUniformBuffer.get();
+    if (encoderState_.vertexUniformBuffer == buffer) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindBuffer(kVertexUniformBlockIndex, buffer, 0);
+    encoderState_.vertexUniformBuffer = buffer;
+  }
+
+  void bindFragmentBufferState(igl::IBuffer* buffer, size_t offset, size_t size) {
+    if (encoderState_.fragmentBuffer == buffer && encoderState_.fragmentBufferOffset == offset) {
+      stats_.elidedBinds++;
+      return;
+    }
+    renderEncoder_->bindBuffer(kFragmentUniformBlockIndex, buffer, offset, size);
+    encoderState_.fragmentBuffer = buffer;
+    encoderState_.fragmentBufferOffset = offset;
+  }
+
+  void bindTextureState(igl::ITexture* texture, igl::ISamplerState* sampler) {
+    if (encoderState_.texture == texture && encoderState_.sampler == sampler) {
+      stats_.elidedBinds++;
+      return;
+    }
+    if (encoderState_.texture != texture) {
+      renderEncoder_->bindTexture(0, igl::BindTarget::kFragment, texture);
+      encoderState_.texture = texture;
+    }
+    if (encoderState_.sampler != sampler) {
+      renderEncoder_->bindSamplerState(0, igl::BindTarget::kFragment, sampler);
+      encoderState_.sampler = sampler;
+    }
+  }
+
   void bindRenderPipeline(const std::shared_ptr<igl::IRenderPipelineState>& pipelineState,
                           const UniformBufferIndex* uboIndex = nullptr) {
-    renderEncoder_->bindRenderPipelineState(pipelineState);
-    renderEncoder_->bindVertexBuffer(kVertexInputIndex, *curBuffers_->vertBuffer, 0);
-    renderEncoder_->bindBuffer(kVertexUniformBlockIndex, curBuffers_->vertexUniformBuffer.get(), 0);
+    bindPipelineState(pipelineState);
+    bindVertexBufferState();
+    bindVertexUniformBufferState();
+    if (paintTable_) {
+      igl::IBuffer* paintTable = curBuffers_->paintTableBuffer.get();
+      bindFragmentBufferState(paintTable, 0, paintTable->getSizeInBytes());
+    }
     if (uboIndex) {
-      renderEncoder_->bindBuffer(kFragmentUniformBlockIndex, uboIndex->buffer, uboIndex->offset);
+      bindFragmentUniforms(*uboIndex);
+    }
+  }
+
+  void bindFragmentUniforms(const UniformBufferIndex& uboIndex) {
+    if (pushConstants_) {
+      renderEncoder_->bindPushConstants(uboIndex.data, sizeof(FragmentUniforms));
+      return;
+    }
+    if (paintTable_) {
+      // The offset is relative to the start of the pool, which is the paint table.
+      paintInstance_ = (uint32_t)(uboIndex.offset / sizeof(FragmentUniforms));
+      return;
+    }
+
+    // Ring buffer indexes are relative to the frame's range in the uniform ring buffer.
+    igl::IBuffer* buffer = uboIndex.buffer;
+    size_t offset = uboIndex.offset;
+    if (buffer == nullptr) {
+      buffer = curBuffers_->uniformBuffer.get();
+      offset += curBuffers_->uniformBufferOffset;
     }
+    bindFragmentBufferState(buffer, offset, fragmentUniformBufferSize_);
   }
 
   void convexFill(Call* call) {
-    const int kIndexBufferOffset = call->indexOffset * indexSize_;
     bindRenderPipeline(pipelineState_);
+    bindDepthStencilState(defaultStencilState_);
     setUniforms(call->uboIndex, call->image);
     if (call->indexCount > 0) {
-      renderEncoder_->bindIndexBuffer(
-          *curBuffers_->indexBuffer, igl::IndexFormat::UInt32, kIndexBufferOffset);
-      renderEncoder_->drawIndexed(call->indexCount);
+      bindIndexBufferState();
+      renderEncoder_->drawIndexed(call->indexCount, 1, call->indexOffset, 0, paintInstance_);
     }
 
     // Draw fringes
     if (call->strokeCount > 0) {
       bindRenderPipeline(pipelineStateTriangleStrip_);
-      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
     }
   }
 
   void fill(Call* call) {
     // Draws shapes.
-    const int kIndexBufferOffset = call->indexOffset * indexSize_;
     bindRenderPipeline(stencilOnlyPipelineState_, &call->uboIndex);
-    renderEncoder_->bindDepthStencilState(fillShapeStencilState_);
+    bindDepthStencilState(fillShapeStencilState_);
+    bindStencilReferenceState(0);
     if (call->indexCount > 0) {
-      renderEncoder_->bindIndexBuffer(
-          *curBuffers_->indexBuffer, igl::IndexFormat::UInt32, kIndexBufferOffset);
-      renderEncoder_->drawIndexed(call->indexCount);
+      bindIndexBufferState();
+      renderEncoder_->drawIndexed(call->indexCount, 1, call->indexOffset, 0, paintInstance_);
     }
 
     // Restores states.
     bindRenderPipeline(pipelineStateTriangleStrip_);
 
-    // Draws anti-aliased fragments.
-    setUniforms(call->uboIndex, call->image);
-    if (flags_ & NVG_ANTIALIAS && call->strokeCount > 0) {
-      renderEncoder_->bindDepthStencilState(fillAntiAliasStencilState_);
-      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset);
+    // Draws anti-aliased fragments.
+    setUniforms(call->uboIndex, call->image);
+    if (flags_ & NVG_ANTIALIAS && call->strokeCount > 0) {
+      bindDepthStencilState(fillAntiAliasStencilState_);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
+    }
+
+    // Draws fill.
+    bindDepthStencilState(fillStencilState_);
+    renderEncoder_->draw(call->triangleCount, 1, call->triangleOffset, paintInstance_);
+  }
+
+  // Draws the fills of a run prepared by prepareMultiDrawFills() pass by pass, one multi-draw per
+  // pass. Their bounds do not overlap, so the order of the passes does not change the output.
+  void multiDrawFill(Call* call) {
+    igl::IBuffer& indirectBuffer = *curBuffers_->indirectBuffer;
+    const uint32_t count = (uint32_t)call->multiDrawCount;
+    size_t offset = call->multiDrawOffset;
+
+    // Draws shapes.
+    bindRenderPipeline(stencilOnlyPipelineState_);
+    bindDepthStencilState(fillShapeStencilState_);
+    bindStencilReferenceState(0);
+    bindIndexBufferState();
+    renderEncoder_->multiDrawIndexedIndirect(
+        indirectBuffer, offset, count, sizeof(DrawIndexedIndirectCommand));
+    offset += count * sizeof(DrawIndexedIndirectCommand);
+
+    // Draws anti-aliased fragments.
+    bindRenderPipeline(pipelineStateTriangleStrip_);
+    setUniforms(call->uboIndex, call->image);
+    if (flags_ & NVG_ANTIALIAS) {
+      bindDepthStencilState(fillAntiAliasStencilState_);
+      renderEncoder_->multiDrawIndirect(
+          indirectBuffer, offset, count, sizeof(DrawIndirectCommand));
+    }
+    offset += count * sizeof(DrawIndirectCommand);
+
+    // Draws fills.
+    bindDepthStencilState(fillStencilState_);
+    renderEncoder_->multiDrawIndirect(indirectBuffer, offset, count, sizeof(DrawIndirectCommand));
+  }
+
+  // Whether `call` can be drawn in the same multi-draw as the `n` fills of `run`.
+  bool canMultiDrawFill(const Call* run, int n, const Call& call) const {
+    // Stencil clears are drawn before the first fill of the run.
+    if (call.type != MNVG_FILL || call.clearsStencil || call.image != run[0].image ||
+        !blendEquals(call.blendFunc, run[0].blendFunc) || !scissorRectEquals(call, run[0])) {
+      return false;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (boundsOverlap(run[i].bounds, call.bounds)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether `call` can be drawn by batchFill() with the fills of `run`: same paint, its indexes
+  // continue the ones of the run and it overlaps none of them.
+  bool canBatchFill(const Call* run, int n, const Call& call) const {
+    const Call& last = run[n - 1];
+    if (call.type != MNVG_FILL || call.clearsStencil || call.image != run[0].image ||
+        call.uboIndex.data != run[0].uboIndex.data ||
+        !blendEquals(call.blendFunc, run[0].blendFunc) || !scissorRectEquals(call, run[0]) ||
+        last.indexOffset + last.indexCount != call.indexOffset) {
+      return false;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (boundsOverlap(run[i].bounds, call.bounds)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Finds runs of consecutive fills that can be drawn together and writes the cover quad of
+  // each run, over the bounds of its fills. Runs before the vertices are uploaded.
+  void prepareFillBatches(Call* calls, int ncalls) {
+    for (int i = 0; i < ncalls;) {
+      if (calls[i].type != MNVG_FILL) {
+        i++;
+        continue;
+      }
+      int n = 1;
+      while (i + n < ncalls && n < kMaxBatchedFills && canBatchFill(&calls[i], n, calls[i + n])) {
+        n++;
+      }
+      if (n > 1) {
+        float bounds[4];
+        initBounds(bounds);
+        for (int j = 0; j < n; ++j) {
+          bounds[0] = std::min(bounds[0], calls[i + j].bounds[0]);
+          bounds[1] = std::min(bounds[1], calls[i + j].bounds[1]);
+          bounds[2] = std::max(bounds[2], calls[i + j].bounds[2]);
+          bounds[3] = std::max(bounds[3], calls[i + j].bounds[3]);
+        }
+        const int offset = allocVerts(4);
+        writeVert(offset + 0, bounds[2], bounds[3], 0.5f, 1.0f);
+        writeVert(offset + 1, bounds[2], bounds[1], 0.5f, 1.0f);
+        writeVert(offset + 2, bounds[0], bounds[3], 0.5f, 1.0f);
+        writeVert(offset + 3, bounds[0], bounds[1], 0.5f, 1.0f);
+        calls[i].fillBatchCount = n;
+        calls[i].fillBatchCoverOffset = offset;
+        stats_.batchedFills += n - 1;
+      }
+      i += n;
+    }
+  }
+
+  // Draws the fills of a batch prepared by prepareFillBatches() like fill() draws one: their
+  // indexes are contiguous, their stencil does not overlap and they share their paint, so the
+  // stencil and cover passes are one draw each. Only the fringes are drawn per fill.
+  void batchFill(Call* call) {
+    const int count = call->fillBatchCount;
+    const Call& last = call[count - 1];
+
+    // Draws shapes.
+    bindRenderPipeline(stencilOnlyPipelineState_, &call->uboIndex);
+    bindDepthStencilState(fillShapeStencilState_);
+    bindStencilReferenceState(0);
+    bindIndexBufferState();
+    renderEncoder_->drawIndexed(last.indexOffset + last.indexCount - call->indexOffset,
+                                1,
+                                call->indexOffset,
+                                0,
+                                paintInstance_);
+
+    // Draws anti-aliased fragments.
+    bindRenderPipeline(pipelineStateTriangleStrip_);
+    setUniforms(call->uboIndex, call->image);
+    if (flags_ & NVG_ANTIALIAS) {
+      bindDepthStencilState(fillAntiAliasStencilState_);
+      for (int i = 0; i < count; ++i) {
+        if (call[i].strokeCount > 0) {
+          renderEncoder_->draw(call[i].strokeCount, 1, call[i].strokeOffset, paintInstance_);
+        }
+      }
+    }
+
+    // Draws fills.
+    bindDepthStencilState(fillStencilState_);
+    renderEncoder_->draw(4, 1, call->fillBatchCoverOffset, paintInstance_);
+  }
+
+  // Finds runs of consecutive fills that can be drawn together and uploads their indirect draws:
+  // the stencil draws of a run, then its fringe draws, then its cover draws. The base instance of
+  // every draw selects its paint in the paint table. Returns the number of uploaded bytes.
+  size_t prepareMultiDrawFills(Buffers& buffers, Call* calls, int ncalls) {
+    Vector<unsigned char>& commands = buffers.indirectCommands;
+    commands.clear();
+    for (int i = 0; i < ncalls;) {
+      if (calls[i].type != MNVG_FILL) {
+        i++;
+        continue;
+      }
+      int n = 1;
+      while (i + n < ncalls && n < kMaxMultiDrawFills &&
+             canMultiDrawFill(&calls[i], n, calls[i + n])) {
+        n++;
+      }
+      if (n == 1) {
+        i++;
+        continue;
+      }
+
+      const size_t offset = commands.size();
+      commands.resize(offset +
+                      n * (sizeof(DrawIndexedIndirectCommand) + 2 * sizeof(DrawIndirectCommand)));
+      DrawIndexedIndirectCommand* shapes = (DrawIndexedIndirectCommand*)&commands[offset];
+      DrawIndirectCommand* fringes = (DrawIndirectCommand*)(shapes + n);
+      DrawIndirectCommand* covers = fringes + n;
+      for (int j = 0; j < n; ++j) {
+        const Call& call = calls[i + j];
+        const uint32_t paint = (uint32_t)(call.uboIndex.offset / sizeof(FragmentUniforms));
+        shapes[j] = {(uint32_t)call.indexCount, 1, (uint32_t)call.indexOffset, 0, paint};
+        const uint32_t strokeCount = (uint32_t)std::max(call.strokeCount, 0);
+        fringes[j] = {strokeCount, 1, (uint32_t)call.strokeOffset, paint};
+        covers[j] = {(uint32_t)call.triangleCount, 1, (uint32_t)call.triangleOffset, paint};
+      }
+      calls[i].multiDrawCount = n;
+      calls[i].multiDrawOffset = offset;
+      stats_.multiDrawFills += n;
+      i += n;
     }
 
-    // Draws fill.
-    renderEncoder_->bindDepthStencilState(fillStencilState_);
-    renderEncoder_->draw(call->triangleCount, 1, call->triangleOffset);
-    renderEncoder_->bindDepthStencilState(defaultStencilState_);
+    if (commands.empty()) {
+      return 0;
+    }
+    if (buffers.indirectBuffer == nullptr ||
+        buffers.indirectBuffer->getSizeInBytes() < commands.size()) {
+      igl::BufferDesc desc(igl::BufferDesc::BufferTypeBits::Indirect,
+                           nullptr,
+                           commands.capacity(),
+                           igl::ResourceStorage::Shared);
+      desc.debugName = "indirect_buffer";
+      buffers.indirectBuffer = createBuffer(device_, desc, &stats_);
+    }
+    buffers.indirectBuffer->upload(commands.data(), igl::BufferRange(commands.size()));
+    return commands.size();
   }
 
   std::shared_ptr<Texture> findTexture(int _id) {
@@ -595,20 +2560,48 @@ class Context {
   }
 
   void renderCancel() {
+    commandBuffer_ = nullptr;
+    stencilRef_ = 0;
+    if (curBuffers_ == nullptr) {
+      return;
+    }
     curBuffers_->image = 0;
-    curBuffers_->isBusy = false;
     curBuffers_->nindexes = 0;
     curBuffers_->nverts = 0;
     curBuffers_->ncalls = 0;
+    if (mappedRings_) {
+      curBuffers_->releaseRingRegions();
+    }
     curBuffers_->uniformBufferPool->reset();
+    curBuffers_->resetUniformSlots();
+    freeBuffers_.emplace_back(std::move(curBuffers_));
   }
 
   void renderCommandEncoderWithColorTexture() {
+    // The encoder may have been used by the application since the last flush.
+    encoderState_ = EncoderState();
     renderEncoder_->setStencilReferenceValue(0);
     renderEncoder_->bindViewport(
         {0.0, 0.0, (float)viewPortSize_.x, (float)viewPortSize_.y, 0.0, 1.0});
-    renderEncoder_->bindVertexBuffer(kVertexInputIndex, *curBuffers_->vertBuffer, 0);
-    renderEncoder_->bindBuffer(kVertexUniformBlockIndex, curBuffers_->vertexUniformBuffer.get(), 0);
+    bindVertexBufferState();
+    bindVertexUniformBufferState();
+  }
+
+  // Concatenates a shader header and body. `version`, if not null, replaces the #version line
+  // that the header starts with.
+  String shaderSource(const std::string& header,
+                      const std::string& body,
+                      const char* version = nullptr) const {
+    size_t headerStart = 0;
+    String source{StlAllocator<char>(&allocator_)};
+    if (version != nullptr) {
+      headerStart = header.find('\n');
+      IGL_DEBUG_ASSERT(header.compare(0, 9, "#version ") == 0 && headerStart != std::string::npos);
+      source.append(version);
+    }
+    source.append(header.data() + headerStart, header.size() - headerStart);
+    source.append(body);
+    return source;
   }
 
   int renderCreate() {
@@ -617,33 +2610,55 @@ class Context {
     igl::Result result;
 
     if (device_->getBackendType() == igl::BackendType::Metal) {
-      const std::string vertexEntryPoint = "vertexShader";
+      std::string vertexEntryPoint = "vertexShader";
       std::string fragmentEntryPoint = (flags_ & NVG_ANTIALIAS) ? "fragmentShaderAA"
                                                                 : "fragmentShader";
+      if (paintTable_) {
+        vertexEntryPoint += "PaintTable";
+        fragmentEntryPoint += "PaintTable";
+      }
 
+      // The glyph vertex function is compiled with the others, into the same library.
+      std::vector<igl::ShaderModuleInfo> modules(glyphInstances_ ? 3 : 2);
+      modules[0].stage = igl::ShaderStage::Vertex;
+      modules[0].entryPoint = vertexEntryPoint;
+      modules[1].stage = igl::ShaderStage::Fragment;
+      modules[1].entryPoint = fragmentEntryPoint;
+      if (glyphInstances_) {
+        modules[2].stage = igl::ShaderStage::Vertex;
+        modules[2].entryPoint = "glyphVertexShader";
+      }
       std::unique_ptr<igl::IShaderLibrary> shader_library =
           igl::ShaderLibraryCreator::fromStringInput(
-              *device_, metalShader.c_str(), vertexEntryPoint, fragmentEntryPoint, "", &result);
+              *device_, metalShader.c_str(), std::move(modules), "", &result);
+      IGL_DEBUG_ASSERT(result.isOk());
 
       vertexFunction_ = shader_library->getShaderModule(vertexEntryPoint);
       fragmentFunction_ = shader_library->getShaderModule(fragmentEntryPoint);
+
+      if (glyphInstances_) {
+        glyphShaderStages_ = igl::ShaderStagesCreator::fromRenderModules(
+            *device_,
+            shader_library->getShaderModule("glyphVertexShader"),
+            fragmentFunction_,
+            &result);
+        IGL_DEBUG_ASSERT(result.isOk());
+      }
     } else if (device_->getBackendType() == igl::BackendType::OpenGL) {
 #if IGL_PLATFORM_ANDROID || IGL_PLATFORM_IOS || IGL_PLATFORM_LINUX
-      auto codeVS = std::regex_replace(
-          openglVertexShaderHeader410, std::regex("#version 410"), "#version 300 es");
-      auto codeFS = std::regex_replace(
-          openglFragmentShaderHeader410, std::regex("#version 410"), "#version 300 es");
-
-      codeVS += openglVertexShaderBody;
-      codeFS += ((flags_ & NVG_ANTIALIAS) ? openglAntiAliasingFragmentShaderBody
-                                          : openglNoAntiAliasingFragmentShaderBody);
+      const char* version = "#version 300 es";
 #else
-      auto codeVS = openglVertexShaderHeader410 + openglVertexShaderBody;
-      auto codeFS = openglFragmentShaderHeader410 + ((flags_ & NVG_ANTIALIAS)
-                                                         ? openglAntiAliasingFragmentShaderBody
-                                                         : openglNoAntiAliasingFragmentShaderBody);
-
+      const char* version = nullptr;
 #endif
+      const String codeVS =
+          shaderSource(openglVertexShaderHeader410, openglVertexShaderBody, version);
+      const String codeFS = shaderSource(openglFragmentShaderHeader410,
+                                         (flags_ & NVG_ANTIALIAS)
+                                             ? openglAntiAliasingFragmentShaderBody
+                                             : openglNoAntiAliasingFragmentShaderBody,
+                                         version);
+      const String codeGlyphVS =
+          shaderSource(openglGlyphVertexShaderHeader410, openglGlyphVertexShaderBody, version);
 
       std::unique_ptr<igl::IShaderStages> shader_stages =
           igl::ShaderStagesCreator::fromModuleStringInput(
@@ -651,11 +2666,23 @@ class Context {
 
       vertexFunction_ = shader_stages->getVertexModule();
       fragmentFunction_ = shader_stages->getFragmentModule();
+
+      if (glyphInstances_) {
+        glyphShaderStages_ = igl::ShaderStagesCreator::fromModuleStringInput(
+            *device_, codeGlyphVS.c_str(), "main", "", codeFS.c_str(), "main", "", nullptr);
+      }
     } else if (device_->getBackendType() == igl::BackendType::Vulkan) {
-      auto codeVS = openglVertexShaderHeader460 + openglVertexShaderBody;
-      auto codeFS = openglFragmentShaderHeader460 + ((flags_ & NVG_ANTIALIAS)
-                                                         ? openglAntiAliasingFragmentShaderBody
-                                                         : openglNoAntiAliasingFragmentShaderBody);
+      const String codeVS = shaderSource(
+          paintTable_ ? openglVertexShaderHeader460PaintTable : openglVertexShaderHeader460,
+          openglVertexShaderBody);
+      const String codeFS = shaderSource(pushConstants_ ? openglFragmentShaderHeader460PushConstants
+                                         : paintTable_ ? openglFragmentShaderHeader460PaintTable
+                                                       : openglFragmentShaderHeader460,
+                                         (flags_ & NVG_ANTIALIAS)
+                                             ? openglAntiAliasingFragmentShaderBody
+                                             : openglNoAntiAliasingFragmentShaderBody);
+      const String codeGlyphVS =
+          shaderSource(openglGlyphVertexShaderHeader460, openglGlyphVertexShaderBody);
 
       std::unique_ptr<igl::IShaderStages> shader_stages =
           igl::ShaderStagesCreator::fromModuleStringInput(
@@ -663,31 +2690,112 @@ class Context {
 
       vertexFunction_ = shader_stages->getVertexModule();
       fragmentFunction_ = shader_stages->getFragmentModule();
-    }
 
-    maxBuffers_ = 3;
+      if (glyphInstances_) {
+        glyphShaderStages_ = igl::ShaderStagesCreator::fromModuleStringInput(
+            *device_, codeGlyphVS.c_str(), "main", "", codeFS.c_str(), "main", "", nullptr);
+      }
+    }
 
-    for (int i = maxBuffers_; i--;) {
-      allBuffers_.emplace_back(std::make_shared<Buffers>(device_, maxUniformBufferSize_));
+    const bool ringBuffers = flags_ & NVG_RING_BUFFERS;
+    if (ringBuffers) {
+      mappedRings_ = device_->getBackendType() != igl::BackendType::OpenGL;
+      vertexRing_ = makeShared<RingBuffer>(&allocator_,
+                                           device_,
+                                           igl::BufferDesc::BufferTypeBits::Vertex,
+                                           "vertex_ring_buffer",
+                                           sizeof(NVGvertex),
+                                           kVertexRingBufferSize,
+                                           mappedRings_,
+                                           &allocator_,
+                                           &stats_);
+      indexRing_ = makeShared<RingBuffer>(&allocator_,
+                                          device_,
+                                          igl::BufferDesc::BufferTypeBits::Index,
+                                          "index_ring_buffer",
+                                          sizeof(uint32_t),
+                                          kIndexRingBufferSize,
+                                          mappedRings_,
+                                          &allocator_,
+                                          &stats_);
+      // Pushed paints and the paint table keep fragment uniforms in CPU staging only.
+      if (!pushConstants_ && !paintTable_) {
+        uniformRing_ = makeShared<RingBuffer>(&allocator_,
+                                              device_,
+                                              igl::BufferDesc::BufferTypeBits::Uniform,
+                                              "fragment_uniform_ring_buffer",
+                                              uniformBufferAlignment_,
+                                              kUniformRingBufferSize,
+                                              false,
+                                              &allocator_,
+                                              &stats_);
+      }
+    }
+    // After the rings, which newBuffers() hands to the sets.
+    for (int i = maxFramesInFlight_; i--;) {
+      allBuffers_.emplace_back(newBuffers());
     }
+    freeBuffers_ = allBuffers_;
 
     // Initializes vertex descriptor.
+    const bool compactVertices = flags_ & NVG_COMPACT_VERTICES;
     vertexDescriptor_.numAttributes = 2;
-    vertexDescriptor_.attributes[0].format = igl::VertexAttributeFormat::Float2;
+    vertexDescriptor_.attributes[0].format = compactVertices
+                                                 ? igl::VertexAttributeFormat::Short2Norm
+                                                 : igl::VertexAttributeFormat::Float2;
     vertexDescriptor_.attributes[0].name = "pos";
     vertexDescriptor_.attributes[0].bufferIndex = 0;
-    vertexDescriptor_.attributes[0].offset = offsetof(NVGvertex, x);
+    vertexDescriptor_.attributes[0].offset =
+        compactVertices ? offsetof(CompactVertex, x) : offsetof(NVGvertex, x);
     vertexDescriptor_.attributes[0].location = 0;
 
-    vertexDescriptor_.attributes[1].format = igl::VertexAttributeFormat::Float2;
+    vertexDescriptor_.attributes[1].format = compactVertices
+                                                 ? igl::VertexAttributeFormat::UShort2Norm
+                                                 : igl::VertexAttributeFormat::Float2;
     vertexDescriptor_.attributes[1].name = "tcoord";
     vertexDescriptor_.attributes[1].bufferIndex = 0;
-    vertexDescriptor_.attributes[1].offset = offsetof(NVGvertex, u);
+    vertexDescriptor_.attributes[1].offset =
+        compactVertices ? offsetof(CompactVertex, u) : offsetof(NVGvertex, u);
     vertexDescriptor_.attributes[1].location = 1;
 
     vertexDescriptor_.numInputBindings = 1;
-    vertexDescriptor_.inputBindings[0].stride = sizeof(NVGvertex);
+    vertexDescriptor_.inputBindings[0].stride = vertexSize_;
     vertexDescriptor_.inputBindings[0].sampleFunction = igl::VertexSampleFunction::PerVertex;
+    vertexInputState_ = device_->createVertexInputState(vertexDescriptor_, &result);
+    IGL_DEBUG_ASSERT(result.isOk());
+
+    if (glyphInstances_) {
+      igl::VertexInputStateDesc glyphDescriptor;
+      glyphDescriptor.numAttributes = 2;
+      glyphDescriptor.attributes[0].format = igl::VertexAttributeFormat::Float4;
+      glyphDescriptor.attributes[0].name = "rect";
+      glyphDescriptor.attributes[0].bufferIndex = 0;
+      glyphDescriptor.attributes[0].offset = offsetof(GlyphInstance, x);
+      glyphDescriptor.attributes[0].location = 0;
+
+      glyphDescriptor.attributes[1].format = igl::VertexAttributeFormat::UShort4Norm;
+      glyphDescriptor.attributes[1].name = "uvRect";
+      glyphDescriptor.attributes[1].bufferIndex = 0;
+      glyphDescriptor.attributes[1].offset = offsetof(GlyphInstance, s0);
+      glyphDescriptor.attributes[1].location = 1;
+
+      glyphDescriptor.numInputBindings = 1;
+      glyphDescriptor.inputBindings[0].stride = sizeof(GlyphInstance);
+      glyphDescriptor.inputBindings[0].sampleFunction = igl::VertexSampleFunction::Instance;
+      glyphVertexInputState_ = device_->createVertexInputState(glyphDescriptor, &result);
+      IGL_DEBUG_ASSERT(result.isOk());
+    }
+
+    // Initializes shader stages shared by all pipelines.
+    shaderStages_ = igl::ShaderStagesCreator::fromRenderModules(
+        *device_, vertexFunction_, fragmentFunction_, &result);
+    IGL_DEBUG_ASSERT(result.isOk());
+    stencilOnlyShaderStages_ = igl::ShaderStagesCreator::fromRenderModules(
+        *device_,
+        vertexFunction_,
+        device_->getBackendType() == igl::BackendType::Metal ? nullptr : fragmentFunction_,
+        &result);
+    IGL_DEBUG_ASSERT(result.isOk());
 
     // Initialzes textures.
     textureId_ = 0;
@@ -704,13 +2812,6 @@ class Context {
       pseudoTexture_ = tex->tex;
     }
 
-    // Initializes default blend states.
-    blendFunc_ = (Blend*)malloc(sizeof(Blend));
-    blendFunc_->srcRGB = igl::BlendFactor::One;
-    blendFunc_->dstRGB = igl::BlendFactor::OneMinusSrcAlpha;
-    blendFunc_->srcAlpha = igl::BlendFactor::One;
-    blendFunc_->dstAlpha = igl::BlendFactor::OneMinusSrcAlpha;
-
     // Initializes stencil states.
     igl::DepthStencilStateDesc stencilDescriptor;
 
@@ -784,6 +2885,26 @@ class Context {
     stencilDescriptor.frontFaceStencil = frontFaceStencilDescriptor;
     stencilDescriptor.debugName = "strokeClearStencilState";
     strokeClearStencilState_ = device_->createDepthStencilState(stencilDescriptor, &result);
+
+    // Rolling stroke shape stencil, writes the reference of the stroke.
+    frontFaceStencilDescriptor.stencilCompareFunction = igl::CompareFunction::NotEqual;
+    frontFaceStencilDescriptor.stencilFailureOperation = igl::StencilOperation::Keep;
+    frontFaceStencilDescriptor.depthFailureOperation = igl::StencilOperation::Keep;
+    frontFaceStencilDescriptor.depthStencilPassOperation = igl::StencilOperation::Replace;
+
+    stencilDescriptor.backFaceStencil = igl::StencilStateDesc();
+    stencilDescriptor.frontFaceStencil = frontFaceStencilDescriptor;
+    stencilDescriptor.debugName = "strokeShapeRollingStencilState";
+    strokeShapeRollingStencilState_ = device_->createDepthStencilState(stencilDescriptor, &result);
+
+    // Rolling stroke anti-aliased stencil.
+    frontFaceStencilDescriptor.depthStencilPassOperation = igl::StencilOperation::Keep;
+
+    stencilDescriptor.backFaceStencil = igl::StencilStateDesc();
+    stencilDescriptor.frontFaceStencil = frontFaceStencilDescriptor;
+    stencilDescriptor.debugName = "strokeAntiAliasRollingStencilState";
+    strokeAntiAliasRollingStencilState_ =
+        device_->createDepthStencilState(stencilDescriptor, &result);
     return 1;
   }
 
@@ -856,13 +2977,16 @@ class Context {
   }
 
   void renderDelete() {
+    if (prewarmThread_.joinable()) {
+      prewarmThread_.join();
+    }
     for (auto& buffers : allBuffers_) {
-      buffers->commandBuffer = nullptr;
       buffers->vertexUniformBuffer = nullptr;
       buffers->stencilTexture = nullptr;
       buffers->indexBuffer = nullptr;
       buffers->vertBuffer = nullptr;
       buffers->uniformBufferPool = nullptr;
+      buffers->indirectBuffer = nullptr;
     }
 
     for (auto& texture : textures_) {
@@ -870,18 +2994,37 @@ class Context {
       texture->sampler = nullptr;
     }
 
-    free(blendFunc_);
     renderEncoder_ = nullptr;
     textures_.clear();
     allBuffers_.clear();
+    freeBuffers_.clear();
+    submissions_.clear();
+    firstSubmission_ = 0;
+    numSubmissions_ = 0;
+    curBuffers_ = nullptr;
+    commandBuffer_ = nullptr;
+    vertexRing_ = nullptr;
+    indexRing_ = nullptr;
+    uniformRing_ = nullptr;
     defaultStencilState_ = nullptr;
     fillShapeStencilState_ = nullptr;
     fillAntiAliasStencilState_ = nullptr;
     strokeShapeStencilState_ = nullptr;
     strokeAntiAliasStencilState_ = nullptr;
     strokeClearStencilState_ = nullptr;
+    strokeShapeRollingStencilState_ = nullptr;
+    strokeAntiAliasRollingStencilState_ = nullptr;
     pipelineState_ = nullptr;
+    pipelineStateTriangleStrip_ = nullptr;
     stencilOnlyPipelineState_ = nullptr;
+    stencilOnlyPipelineStateTriangleStrip_ = nullptr;
+    glyphPipelineState_ = nullptr;
+    pipelineCache_.clear();
+    shaderStages_ = nullptr;
+    stencilOnlyShaderStages_ = nullptr;
+    vertexInputState_ = nullptr;
+    glyphShaderStages_ = nullptr;
+    glyphVertexInputState_ = nullptr;
     pseudoSampler_ = nullptr;
     pseudoTexture_ = nullptr;
     device_ = nullptr;
@@ -909,8 +3052,14 @@ class Context {
                            const float* bounds,
                            const NVGpath* paths,
                            int npaths) {
+    // Fringes extend the bounds by up to a fringe.
+    const float fringeBounds[4] = {
+        bounds[0] - fringe, bounds[1] - fringe, bounds[2] + fringe, bounds[3] + fringe};
+    if (scissorRejects(scissor, fringeBounds, fringe)) {
+      return;
+    }
+
     Call* call = allocCall();
-    NVGvertex* quad = nullptr;
 
     if (call == NULL)
       return;
@@ -919,6 +3068,17 @@ class Context {
     call->triangleCount = 4;
     call->image = paint->image;
     call->blendFunc = blendCompositeOperation(compositeOperation);
+    hardwareScissor(scissor, fringe, call->scissorRect);
+
+    if ((flags_ & NVG_ANALYTIC_SHAPES) && npaths == 1 && paths[0].convex &&
+        renderAnalyticFill(call, paint, scissor, fringe, &paths[0])) {
+      return;
+    }
+
+    if (npaths == 1 && !paths[0].convex && paths[0].nfill <= triangulateMaxVertices_ &&
+        renderTriangulatedFill(call, paint, scissor, fringe, &paths[0])) {
+      return;
+    }
 
     if (npaths == 1 && paths[0].convex) {
       call->type = MNVG_CONVEXFILL;
@@ -928,52 +3088,58 @@ class Context {
     // Allocate vertices for all the paths.
     int indexCount, strokeCount = 0;
     int maxverts = maxVertexCount(paths, npaths, &indexCount, &strokeCount) + call->triangleCount;
-    int vertOffset = allocVerts(maxverts);
-    if (vertOffset == -1) {
-      // We get here if call alloc was ok, but something else is not.
-      // Roll back the last call to prevent drawing it.
-      if (curBuffers_->ncalls > 0)
-        curBuffers_->ncalls--;
-      return;
+    // Batched fills draw their indexes as one range, which the alignment of allocIndexes() would
+    // break after an odd count. A degenerate triangle rounds the count up instead.
+    const bool padIndexes = batchFills_ && call->type == MNVG_FILL && (indexCount & 1);
+    if (padIndexes) {
+      indexCount += 3;
     }
-
+    int vertOffset = allocVerts(maxverts);
     int indexOffset = allocIndexes(indexCount);
-    if (indexOffset == -1) {
-      // We get here if call alloc was ok, but something else is not.
-      // Roll back the last call to prevent drawing it.
-      if (curBuffers_->ncalls > 0)
-        curBuffers_->ncalls--;
-      return;
-    }
     call->indexOffset = indexOffset;
     call->indexCount = indexCount;
-    uint32_t* index = &curBuffers_->indexes[indexOffset];
+    unsigned char* index = &curBuffers_->indexes[indexOffset * curBuffers_->indexSize];
 
     int strokeVertOffset = vertOffset + (maxverts - strokeCount);
     call->strokeOffset = strokeVertOffset + 1;
     call->strokeCount = strokeCount - 2;
-    NVGvertex* strokeVert = curBuffers_->verts.data() + strokeVertOffset;
+    writeStrokeVerts(strokeVertOffset, paths, npaths);
 
     NVGpath* path = (NVGpath*)&paths[0];
     for (int i = npaths; i--; ++path) {
       if (path->nfill > 2) {
-        memcpy(&curBuffers_->verts[vertOffset], path->fill, sizeof(NVGvertex) * path->nfill);
+        writeVerts(vertOffset, path->fill, path->nfill);
 
-        int hubVertOffset = vertOffset++;
-        for (int j = 2; j < path->nfill; j++) {
-          *index++ = hubVertOffset;
-          *index++ = vertOffset++;
-          *index++ = vertOffset;
+        if (curBuffers_->indexSize == sizeof(uint16_t)) {
+          index = (unsigned char*)writeFanIndexes((uint16_t*)index, vertOffset, path->nfill);
+        } else {
+          index = (unsigned char*)writeFanIndexes((uint32_t*)index, vertOffset, path->nfill);
         }
-        vertOffset++;
+        vertOffset += path->nfill;
       }
-      if (path->nstroke > 0) {
-        memcpy(strokeVert, path->stroke, sizeof(NVGvertex));
-        ++strokeVert;
-        memcpy(strokeVert, path->stroke, sizeof(NVGvertex) * path->nstroke);
-        strokeVert += path->nstroke;
-        memcpy(strokeVert, path->stroke + path->nstroke - 1, sizeof(NVGvertex));
-        ++strokeVert;
+    }
+    if (padIndexes) {
+      // Degenerate triangle at the first vertex of the cover quad.
+      for (int i = 0; i < 3; ++i) {
+        if (curBuffers_->indexSize == sizeof(uint16_t)) {
+          ((uint16_t*)index)[i] = (uint16_t)vertOffset;
+        } else {
+          ((uint32_t*)index)[i] = (uint32_t)vertOffset;
+        }
+      }
+    }
+
+    if (callBounds_) {
+      initBounds(call->bounds);
+      for (int i = 0; i < npaths; ++i) {
+        expandBounds(call->bounds, paths[i].fill, paths[i].nfill);
+        expandBounds(call->bounds, paths[i].stroke, paths[i].nstroke);
+      }
+      if (call->type == MNVG_FILL) {
+        call->bounds[0] = std::min(call->bounds[0], bounds[0]);
+        call->bounds[1] = std::min(call->bounds[1], bounds[1]);
+        call->bounds[2] = std::max(call->bounds[2], bounds[2]);
+        call->bounds[3] = std::max(call->bounds[3], bounds[3]);
       }
     }
 
@@ -981,37 +3147,357 @@ class Context {
     if (call->type == MNVG_FILL) {
       // Quad
       call->triangleOffset = vertOffset;
-      quad = &curBuffers_->verts[call->triangleOffset];
-      setVertextData(&quad[0], bounds[2], bounds[3], 0.5f, 1.0f);
-      setVertextData(&quad[1], bounds[2], bounds[1], 0.5f, 1.0f);
-      setVertextData(&quad[2], bounds[0], bounds[3], 0.5f, 1.0f);
-      setVertextData(&quad[3], bounds[0], bounds[1], 0.5f, 1.0f);
+      writeVert(vertOffset + 0, bounds[2], bounds[3], 0.5f, 1.0f);
+      writeVert(vertOffset + 1, bounds[2], bounds[1], 0.5f, 1.0f);
+      writeVert(vertOffset + 2, bounds[0], bounds[3], 0.5f, 1.0f);
+      writeVert(vertOffset + 3, bounds[0], bounds[1], 0.5f, 1.0f);
+      // Stencil fills count the winding from zero.
+      allocStencilClear(call);
     }
 
     // Fill shader
-    call->uboIndex = allocFragUniforms(fragmentUniformBufferSize_);
-    convertPaintForFrag(
-        (FragmentUniforms*)call->uboIndex.data, paint, scissor, fringe, fringe, -1.0f);
+    FragmentUniforms frag;
+    convertPaintForFrag(&frag, paint, scissor, fringe, fringe, -1.0f);
+    call->uboIndex = internFragUniforms(frag);
+  }
+
+  // Draws a simple concave path like a convex fill, from an ear-clipped triangulation instead of
+  // the stencil passes. Its fringe is halved like nanovg does for convex paths, so that the fringe
+  // does not overlap the fill. Returns false, without touching `call`, when the path is not simple
+  // or has spikes too sharp to miter.
+  bool renderTriangulatedFill(Call* call,
+                              NVGpaint* paint,
+                              NVGscissor* scissor,
+                              float fringe,
+                              const NVGpath* path) {
+    const int n = path->nfill;
+    if (n < 3) {
+      return false;
+    }
+    // With antialiasing nvg__expandFill already insets the fill vertices by half a fringe. Solid
+    // paths are wound positively, holes negatively; both fill alone.
+    float area = 0.0f;
+    for (int i = 2; i < n; ++i) {
+      area += triangleArea2(path->fill[0].x,
+                            path->fill[0].y,
+                            path->fill[i - 1].x,
+                            path->fill[i - 1].y,
+                            path->fill[i].x,
+                            path->fill[i].y);
+    }
+    if (area == 0.0f) {
+      return false;
+    }
+    auto point = [path, n, area](int i) -> const NVGvertex& {
+      return path->fill[area > 0.0f ? i : n - 1 - i];
+    };
+
+    // The miters point inwards; the fringe runs from the fill one fringe outwards along them.
+    const bool antiAlias = path->nstroke > 0;
+    float xy[kMaxTriangulatedVertices][2];
+    float miter[kMaxTriangulatedVertices][2];
+    for (int i = 0; i < n; ++i) {
+      const NVGvertex& p0 = point((i + n - 1) % n);
+      const NVGvertex& p1 = point(i);
+      const NVGvertex& p2 = point((i + 1) % n);
+      float d0x = p1.x - p0.x, d0y = p1.y - p0.y;
+      float d1x = p2.x - p1.x, d1y = p2.y - p1.y;
+      const float l0 = sqrtf(d0x * d0x + d0y * d0y);
+      const float l1 = sqrtf(d1x * d1x + d1y * d1y);
+      if (l0 < 1e-6f || l1 < 1e-6f) {
+        return false;
+      }
+      d0x /= l0, d0y /= l0, d1x /= l1, d1y /= l1;
+      float dmx = (d0y + d1y) * 0.5f;
+      float dmy = (-d0x - d1x) * 0.5f;
+      const float dmr2 = dmx * dmx + dmy * dmy;
+      // Miters longer than 4 fringes would fold the fringe over the fill.
+      if (dmr2 < 1.0f / 16.0f) {
+        return false;
+      }
+      miter[i][0] = dmx / dmr2;
+      miter[i][1] = dmy / dmr2;
+      xy[i][0] = p1.x;
+      xy[i][1] = p1.y;
+    }
+
+    int triangles[(kMaxTriangulatedVertices - 2) * 3];
+    if (!isSimplePolygon(xy, n)) {
+      return false;
+    }
+    const int indexCount = earClipPolygon(xy, n, triangles);
+    if (indexCount == 0) {
+      return false;
+    }
+
+    call->type = MNVG_CONVEXFILL;
+    call->triangleCount = 0;
+    const int strokeCount = antiAlias ? (n + 1) * 2 : 0;
+    const int vertOffset = allocVerts(n + strokeCount);
+    call->indexOffset = allocIndexes(indexCount);
+    call->indexCount = indexCount;
+    call->strokeOffset = vertOffset + n;
+    call->strokeCount = strokeCount;
+
+    for (int i = 0; i < n; ++i) {
+      writeVert(vertOffset + i, xy[i][0], xy[i][1], 0.5f, 1.0f);
+    }
+    const float outset = antiAlias ? fringe : 0.0f;
+    float outer[kMaxTriangulatedVertices][2];
+    for (int i = 0; i < n; ++i) {
+      outer[i][0] = xy[i][0] - miter[i][0] * outset;
+      outer[i][1] = xy[i][1] - miter[i][1] * outset;
+    }
+    for (int i = 0; i < strokeCount / 2; ++i) {
+      const int j = i % n;
+      writeVert(call->strokeOffset + i * 2, xy[j][0], xy[j][1], 0.5f, 1.0f);
+      writeVert(call->strokeOffset + i * 2 + 1, outer[j][0], outer[j][1], 1.0f, 1.0f);
+    }
+    unsigned char* index = &curBuffers_->indexes[call->indexOffset * curBuffers_->indexSize];
+    for (int i = 0; i < indexCount; ++i) {
+      if (curBuffers_->indexSize == sizeof(uint16_t)) {
+        ((uint16_t*)index)[i] = (uint16_t)(vertOffset + triangles[i]);
+      } else {
+        ((uint32_t*)index)[i] = (uint32_t)(vertOffset + triangles[i]);
+      }
+    }
+
+    if (callBounds_) {
+      initBounds(call->bounds);
+      for (int i = 0; i < n; ++i) {
+        call->bounds[0] = std::min(call->bounds[0], std::min(xy[i][0], outer[i][0]));
+        call->bounds[1] = std::min(call->bounds[1], std::min(xy[i][1], outer[i][1]));
+        call->bounds[2] = std::max(call->bounds[2], std::max(xy[i][0], outer[i][0]));
+        call->bounds[3] = std::max(call->bounds[3], std::max(xy[i][1], outer[i][1]));
+      }
+    }
+
+    FragmentUniforms frag;
+    convertPaintForFrag(&frag, paint, scissor, fringe, fringe, -1.0f);
+    call->uboIndex = internFragUniforms(frag);
+    stats_.triangulatedFills++;
+    return true;
+  }
+
+  // Draws a solid fill of an analytic shape as one quad, whose coverage is its signed distance
+  // over the fringe width: a box gradient from the color to transparent with a feather of one
+  // fringe. Returns false, without touching `call`, when the fill does not qualify.
+  bool renderAnalyticFill(Call* call,
+                          NVGpaint* paint,
+                          NVGscissor* scissor,
+                          float fringe,
+                          const NVGpath* path) {
+    // Pixels of the quad outside of the shape must not change the destination.
+    const Blend& blend = call->blendFunc;
+    if (paint->image != 0 || memcmp(&paint->innerColor, &paint->outerColor, sizeof(NVGcolor)) ||
+        (blend.dstRGB != igl::BlendFactor::OneMinusSrcAlpha &&
+         blend.dstRGB != igl::BlendFactor::One) ||
+        (blend.dstAlpha != igl::BlendFactor::OneMinusSrcAlpha &&
+         blend.dstAlpha != igl::BlendFactor::One)) {
+      return false;
+    }
+    AnalyticShape shape;
+    if (!fitAnalyticShape(path, &shape)) {
+      return false;
+    }
+
+    NVGpaint shapePaint = *paint;
+    nvgTransformTranslate(shapePaint.xform, shape.cx, shape.cy);
+    shapePaint.extent[0] = shape.hx;
+    shapePaint.extent[1] = shape.hy;
+    shapePaint.radius = shape.radius;
+    shapePaint.feather = fringe;
+    shapePaint.outerColor.a = 0.0f;
+
+    call->type = MNVG_TRIANGLES;
+    call->triangleOffset = allocVerts(6);
+    call->triangleCount = 6;
+    const float x0 = shape.cx - shape.hx - fringe;
+    const float y0 = shape.cy - shape.hy - fringe;
+    const float x1 = shape.cx + shape.hx + fringe;
+    const float y1 = shape.cy + shape.hy + fringe;
+    writeVert(call->triangleOffset + 0, x0, y0, 0.5f, 1.0f);
+    writeVert(call->triangleOffset + 1, x1, y0, 0.5f, 1.0f);
+    writeVert(call->triangleOffset + 2, x1, y1, 0.5f, 1.0f);
+    writeVert(call->triangleOffset + 3, x0, y0, 0.5f, 1.0f);
+    writeVert(call->triangleOffset + 4, x1, y1, 0.5f, 1.0f);
+    writeVert(call->triangleOffset + 5, x0, y1, 0.5f, 1.0f);
+    if (callBounds_) {
+      call->bounds[0] = x0;
+      call->bounds[1] = y0;
+      call->bounds[2] = x1;
+      call->bounds[3] = y1;
+    }
+
+    FragmentUniforms frag;
+    convertPaintForFrag(&frag, &shapePaint, scissor, fringe, fringe, -1.0f);
+    if (shape.ellipse) {
+      frag.type = MNVG_SHADER_FILLELLIPSE;
+    }
+    call->uboIndex = internFragUniforms(frag);
+    stats_.analyticFills++;
+    return true;
+  }
+
+  // Whether `call` can be drawn as part of `prev`: same pipeline, texture and paint, and vertex or
+  // index ranges that continue the ones of `prev`. Identical paints share their uniform block,
+  // see internFragUniforms(), so comparing the blocks compares the paints. Calls with different
+  // paints never merge, also with the paint table: one draw selects one paint by base instance.
+  bool canMergeCalls(const Call& prev, const Call& call) const {
+    if (prev.type != call.type || prev.image != call.image ||
+        prev.uboIndex.data != call.uboIndex.data || !blendEquals(prev.blendFunc, call.blendFunc) ||
+        !scissorRectEquals(prev, call)) {
+      return false;
+    }
+
+    switch (call.type) {
+    case MNVG_TRIANGLES:
+      return prev.triangleOffset + prev.triangleCount == call.triangleOffset;
+    case MNVG_GLYPHS:
+      // Records of a call are padded to whole vertex slots.
+      return prev.triangleOffset * (size_t)vertexSize_ +
+                 prev.triangleCount * sizeof(GlyphInstance) ==
+             call.triangleOffset * (size_t)vertexSize_;
+    case MNVG_CONVEXFILL:
+      // Fringes would be drawn after the fills of later calls.
+      // Fills without a fringe store a negative stroke count, see renderFillWithPaint().
+      return prev.strokeCount <= 0 && call.strokeCount <= 0 &&
+             prev.indexOffset + prev.indexCount == call.indexOffset;
+    case MNVG_STROKE:
+      // Strips of consecutive calls are separated by the repeated last and first vertex of
+      // their paths, which the merged strip draws as degenerate triangles.
+      return !(flags_ & NVG_STENCIL_STROKES) &&
+             prev.strokeOffset + prev.strokeCount + 2 == call.strokeOffset;
+    default:
+      return false;
+    }
+  }
+
+  // Moves every call back to right after the last call with the same type, texture and blend
+  // among the preceding kSortCallsWindow calls, if none of the calls it moves before overlaps it.
+  // Calls that do not overlap are independent, so the rendered output does not change.
+  void sortCalls(Call* calls, int ncalls) {
+    for (int i = 1; i < ncalls; ++i) {
+      int target = i;
+      for (int j = i - 1; j >= 0 && j >= i - kSortCallsWindow; --j) {
+        const Call& prev = calls[j];
+        if (prev.type == calls[i].type && prev.image == calls[i].image &&
+            blendEquals(prev.blendFunc, calls[i].blendFunc)) {
+          target = j + 1;
+          break;
+        }
+        if (boundsOverlap(prev.bounds, calls[i].bounds)) {
+          break;
+        }
+      }
+      if (target == i) {
+        continue;
+      }
+      Call call = calls[i];
+      memmove(&calls[target + 1], &calls[target], (i - target) * sizeof(Call));
+      calls[target] = call;
+      stats_.reorderedCalls++;
+    }
+  }
+
+  // Merges runs of adjacent compatible calls into single calls, returns the number of calls left.
+  int mergeCalls(Call* calls, int ncalls) {
+    if (ncalls == 0) {
+      return 0;
+    }
+
+    int n = 1;
+    for (int i = 1; i < ncalls; ++i) {
+      Call& prev = calls[n - 1];
+      const Call& call = calls[i];
+      if (!canMergeCalls(prev, call)) {
+        calls[n++] = call;
+        continue;
+      }
+      if (call.type == MNVG_TRIANGLES || call.type == MNVG_GLYPHS) {
+        prev.triangleCount += call.triangleCount;
+      } else if (call.type == MNVG_CONVEXFILL) {
+        prev.indexCount += call.indexCount;
+      } else {
+        prev.strokeCount = call.strokeOffset + call.strokeCount - prev.strokeOffset;
+      }
+      stats_.mergedCalls++;
+    }
+    return n;
   }
 
   void renderFlush() {
+    if (curBuffers_ == nullptr) {
+      return;
+    }
+
     // Cancelled if the drawable is invisible.
     if (viewPortSize_.x == 0 || viewPortSize_.y == 0) {
       renderCancel();
       return;
     }
 
-    curBuffers_->uploadToGpu();
+    // Leaves the stencil zero for the next frame.
+    curBuffers_->stencilClearOffset = -1;
+    allocStencilClear(nullptr);
+
+    if (flags_ & NVG_SORT_CALLS) {
+      sortCalls(curBuffers_->calls, curBuffers_->ncalls);
+    }
+    // `ncalls` of the set keeps the recorded count, which sizes later frames.
+    const int ncalls = mergeCalls(curBuffers_->calls, curBuffers_->ncalls);
+    if (batchFills_) {
+      // Writes cover quads, before the vertices are uploaded.
+      prepareFillBatches(curBuffers_->calls, ncalls);
+    }
+
+    if (flags_ & NVG_RING_BUFFERS) {
+      // Ring ranges are released by retireSubmission().
+      stats_.uploadedBytes += curBuffers_->uploadToRingBuffers(
+          *vertexRing_, *indexRing_, uniformRing_.get(), frameIndex_);
+    } else {
+      stats_.uploadedBytes += curBuffers_->uploadToGpu();
+    }
+    if (paintTable_) {
+      stats_.uploadedBytes += uploadPaintTable(*curBuffers_);
+      paintInstance_ = 0;
+    }
+    stats_.frames++;
 
     renderCommandEncoderWithColorTexture();
 
+    if (multiDrawFills_) {
+      stats_.uploadedBytes += prepareMultiDrawFills(*curBuffers_, curBuffers_->calls, ncalls);
+    }
     Call* call = &curBuffers_->calls[0];
-    for (int i = curBuffers_->ncalls; i--; ++call) {
+    for (int i = ncalls; i--; ++call) {
       Blend* blend = &call->blendFunc;
 
       updateRenderPipelineStatesForBlend(blend);
 
-      if (call->type == MNVG_FILL) {
+      if (call->clearsStencil) {
+        clearStencil(call->stencilClearOffset);
+      }
+      if (scissorRects_) {
+        bindScissorRectState(call->scissorRect);
+        if (call->scissorRect[2] > 0) {
+          stats_.hardwareScissorCalls++;
+        }
+      }
+
+      if (call->type == MNVG_FILL && call->multiDrawCount > 1) {
+        renderEncoder_->pushDebugGroupLabel("multiDrawFill");
+        multiDrawFill(call);
+        // The other fills of the run were drawn with the first.
+        i -= call->multiDrawCount - 1;
+        call += call->multiDrawCount - 1;
+      } else if (call->type == MNVG_FILL && call->fillBatchCount > 1) {
+        renderEncoder_->pushDebugGroupLabel("batchFill");
+        batchFill(call);
+        // The other fills of the batch were drawn with the first.
+        i -= call->fillBatchCount - 1;
+        call += call->fillBatchCount - 1;
+      } else if (call->type == MNVG_FILL) {
         renderEncoder_->pushDebugGroupLabel("fill");
         fill(call);
       } else if (call->type == MNVG_CONVEXFILL) {
@@ -1023,18 +3509,32 @@ class Context {
       } else if (call->type == MNVG_TRIANGLES) {
         renderEncoder_->pushDebugGroupLabel("triangles");
         triangles(call);
+      } else if (call->type == MNVG_GLYPHS) {
+        renderEncoder_->pushDebugGroupLabel("glyphs");
+        glyphs(call);
       }
 
       renderEncoder_->popDebugGroupLabel();
     }
+    if (curBuffers_->stencilClearOffset >= 0) {
+      clearStencil(curBuffers_->stencilClearOffset);
+    }
+    // Draws bind the stencil state they need, restores the default one for the application.
+    bindDepthStencilState(defaultStencilState_);
+    bindStencilReferenceState(0);
+    bindScissorRectState(nullptr);
 
-    curBuffers_->isBusy = false;
-    curBuffers_->commandBuffer = nullptr;
+    recordUsage(*curBuffers_);
     curBuffers_->image = 0;
     curBuffers_->nindexes = 0;
     curBuffers_->nverts = 0;
     curBuffers_->ncalls = 0;
     curBuffers_->uniformBufferPool->reset();
+    curBuffers_->resetUniformSlots();
+
+    // The GPU reads this set until the command buffer completes, see retireSubmission().
+    submitBuffers();
+    frameIndex_++;
   }
 
   int renderGetTextureSizeForImage(int image, int* width, int* height) {
@@ -1053,6 +3553,17 @@ class Context {
                              float strokeWidth,
                              const NVGpath* paths,
                              int npaths) {
+    if (scissorRects_) {
+      float bounds[4];
+      initBounds(bounds);
+      for (int i = 0; i < npaths; ++i) {
+        expandBounds(bounds, paths[i].stroke, paths[i].nstroke);
+      }
+      if (scissorRejects(scissor, bounds, fringe)) {
+        return;
+      }
+    }
+
     Call* call = allocCall();
 
     if (call == NULL)
@@ -1061,52 +3572,50 @@ class Context {
     call->type = MNVG_STROKE;
     call->image = paint->image;
     call->blendFunc = blendCompositeOperation(compositeOperation);
+    hardwareScissor(scissor, fringe, call->scissorRect);
 
     // Allocate vertices for all the paths.
     int strokeCount = 0;
     int maxverts = maxVertexCount(paths, npaths, NULL, &strokeCount);
     int offset = allocVerts(maxverts);
-    if (offset == -1) {
-      // We get here if call alloc was ok, but something else is not.
-      // Roll back the last call to prevent drawing it.
-      if (curBuffers_->ncalls > 0)
-        curBuffers_->ncalls--;
-      return;
-    }
 
     call->strokeOffset = offset + 1;
     call->strokeCount = strokeCount - 2;
-    NVGvertex* strokeVert = curBuffers_->verts.data() + offset;
+    writeStrokeVerts(offset, paths, npaths);
 
-    NVGpath* path = (NVGpath*)&paths[0];
-    for (int i = npaths; i--; ++path) {
-      if (path->nstroke > 0) {
-        memcpy(strokeVert, path->stroke, sizeof(NVGvertex));
-        ++strokeVert;
-        memcpy(strokeVert, path->stroke, sizeof(NVGvertex) * path->nstroke);
-        strokeVert += path->nstroke;
-        memcpy(strokeVert, path->stroke + path->nstroke - 1, sizeof(NVGvertex));
-        ++strokeVert;
+    if (callBounds_) {
+      initBounds(call->bounds);
+      for (int i = 0; i < npaths; ++i) {
+        expandBounds(call->bounds, paths[i].stroke, paths[i].nstroke);
+      }
+    }
+
+    if (rollingStencilRefs_) {
+      // Clears the stencil once every reference is in use.
+      if (stencilRef_ == 0xff) {
+        allocStencilClear(call);
       }
+      if (stencilRef_ == 0) {
+        initBounds(stencilDirtyBounds_);
+      }
+      call->stencilRef = ++stencilRef_;
+      stencilDirtyBounds_[0] = std::min(stencilDirtyBounds_[0], call->bounds[0]);
+      stencilDirtyBounds_[1] = std::min(stencilDirtyBounds_[1], call->bounds[1]);
+      stencilDirtyBounds_[2] = std::max(stencilDirtyBounds_[2], call->bounds[2]);
+      stencilDirtyBounds_[3] = std::max(stencilDirtyBounds_[3], call->bounds[3]);
     }
 
+    FragmentUniforms frag;
     if (flags_ & NVG_STENCIL_STROKES) {
       // Fill shader
-      call->uboIndex = allocFragUniforms(fragmentUniformBufferSize_);
-      convertPaintForFrag(
-          (FragmentUniforms*)call->uboIndex.data, paint, scissor, strokeWidth, fringe, -1.0f);
-      call->uboIndex2 = allocFragUniforms(fragmentUniformBufferSize_);
-      convertPaintForFrag((FragmentUniforms*)call->uboIndex2.data,
-                          paint,
-                          scissor,
-                          strokeWidth,
-                          fringe,
-                          (1.0f - 0.5f / 255.0f));
+      convertPaintForFrag(&frag, paint, scissor, strokeWidth, fringe, -1.0f);
+      call->uboIndex = internFragUniforms(frag);
+      convertPaintForFrag(&frag, paint, scissor, strokeWidth, fringe, (1.0f - 0.5f / 255.0f));
+      call->uboIndex2 = internFragUniforms(frag);
     } else {
       // Fill shader
-      call->uboIndex = allocFragUniforms(fragmentUniformBufferSize_);
-      convertPaintForFrag(
-          (FragmentUniforms*)call->uboIndex.data, paint, scissor, strokeWidth, fringe, -1.0f);
+      convertPaintForFrag(&frag, paint, scissor, strokeWidth, fringe, -1.0f);
+      call->uboIndex = internFragUniforms(frag);
     }
   }
 
@@ -1116,6 +3625,15 @@ class Context {
                                 const NVGvertex* verts,
                                 int nverts,
                                 float fringe) {
+    if (scissorRects_) {
+      float bounds[4];
+      initBounds(bounds);
+      expandBounds(bounds, verts, nverts);
+      if (scissorRejects(scissor, bounds, fringe)) {
+        return;
+      }
+    }
+
     Call* call = allocCall();
 
     if (call == NULL)
@@ -1124,25 +3642,27 @@ class Context {
     call->type = MNVG_TRIANGLES;
     call->image = paint->image;
     call->blendFunc = blendCompositeOperation(compositeOperation);
-
-    // Allocate vertices for all the paths.
-    call->triangleOffset = allocVerts(nverts);
-    if (call->triangleOffset == -1) {
-      // We get here if call alloc was ok, but something else is not.
-      // Roll back the last call to prevent drawing it.
-      if (curBuffers_->ncalls > 0)
-        curBuffers_->ncalls--;
-      return;
+    hardwareScissor(scissor, fringe, call->scissorRect);
+    if (callBounds_) {
+      initBounds(call->bounds);
+      expandBounds(call->bounds, verts, nverts);
     }
-    call->triangleCount = nverts;
 
-    memcpy(&curBuffers_->verts[call->triangleOffset], verts, sizeof(NVGvertex) * nverts);
+    if (glyphInstances_ && nverts % 6 == 0 && writeGlyphs(call, verts, nverts / 6)) {
+      call->type = MNVG_GLYPHS;
+    } else {
+      // Allocate vertices for all the paths.
+      call->triangleOffset = allocVerts(nverts);
+      call->triangleCount = nverts;
+
+      writeVerts(call->triangleOffset, verts, nverts);
+    }
 
     // Fill shader
-    call->uboIndex = allocFragUniforms(fragmentUniformBufferSize_);
-    convertPaintForFrag(
-        (FragmentUniforms*)call->uboIndex.data, paint, scissor, 1.0f, fringe, -1.0f);
-    ((FragmentUniforms*)call->uboIndex.data)->type = MNVG_SHADER_IMG;
+    FragmentUniforms frag;
+    convertPaintForFrag(&frag, paint, scissor, 1.0f, fringe, -1.0f);
+    frag.type = MNVG_SHADER_IMG;
+    call->uboIndex = internFragUniforms(frag);
   }
 
   int renderUpdateTextureWithImage(int image,
@@ -1173,15 +3693,19 @@ class Context {
     return 1;
   }
 
-  int bufferIndex = 0;
-
   void renderViewportWithWidth(float width, float height, float device_PixelRatio) {
     viewPortSize_.x = (uint32_t)(width * device_PixelRatio);
     viewPortSize_.y = (uint32_t)(height * device_PixelRatio);
 
-    bufferIndex = (bufferIndex + 1) % 3;
-    curBuffers_ = allBuffers_[bufferIndex];
+    // A set is held from nvgBeginFrame until it is flushed or cancelled.
+    if (curBuffers_ == nullptr) {
+      curBuffers_ = allocBuffers();
+    }
 
+    curBuffers_->vertexUniforms.matrix = vertexMatrix_;
+    // Compact positions are read as snorm16 and scaled back to view units by the vertex shader.
+    curBuffers_->vertexUniforms.positionScale =
+        (flags_ & NVG_COMPACT_VERTICES) ? 32767.0f / compactPositionFactor_ : 1.0f;
     curBuffers_->vertexUniforms.viewSize[0] = width;
     curBuffers_->vertexUniforms.viewSize[1] = height;
 
@@ -1193,21 +3717,18 @@ class Context {
                            igl::ResourceStorage::Shared);
       desc.hint = igl::BufferDesc::BufferAPIHintBits::UniformBlock;
       desc.debugName = "vertex_uniform_buffer";
-      curBuffers_->vertexUniformBuffer = device_->createBuffer(desc, NULL);
+      curBuffers_->vertexUniformBuffer = createBuffer(device_, desc, &stats_);
     }
   }
 
   void setUniforms(const UniformBufferIndex& uboIndex, int image) {
-    renderEncoder_->bindBuffer(
-        kFragmentUniformBlockIndex, uboIndex.buffer, uboIndex.offset, fragmentUniformBufferSize_);
+    bindFragmentUniforms(uboIndex);
 
     std::shared_ptr<Texture> tex = (image == 0 ? nullptr : findTexture(image));
     if (tex != nullptr) {
-      renderEncoder_->bindTexture(0, igl::BindTarget::kFragment, tex->tex.get());
-      renderEncoder_->bindSamplerState(0, igl::BindTarget::kFragment, tex->sampler.get());
+      bindTextureState(tex->tex.get(), tex->sampler.get());
     } else {
-      renderEncoder_->bindTexture(0, igl::BindTarget::kFragment, pseudoTexture_.get());
-      renderEncoder_->bindSamplerState(0, igl::BindTarget::kFragment, pseudoSampler_.get());
+      bindTextureState(pseudoTexture_.get(), pseudoSampler_.get());
     }
   }
 
@@ -1216,47 +3737,177 @@ class Context {
       return;
     }
 
-    if (flags_ & NVG_STENCIL_STROKES) {
+    if (rollingStencilRefs_) {
+      // Fills the stroke base without overlap, where the stencil is not yet the stroke's.
+      bindRenderPipeline(pipelineStateTriangleStrip_);
+      setUniforms(call->uboIndex2, call->image);
+      bindDepthStencilState(strokeShapeRollingStencilState_);
+      bindStencilReferenceState(call->stencilRef);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
+
+      // Draws anti-aliased fragments. The stencil is cleared by a later allocStencilClear() quad.
+      setUniforms(call->uboIndex, call->image);
+      bindDepthStencilState(strokeAntiAliasRollingStencilState_);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
+    } else if (flags_ & NVG_STENCIL_STROKES) {
       // Fills the stroke base without overlap.
       bindRenderPipeline(pipelineStateTriangleStrip_);
       setUniforms(call->uboIndex2, call->image);
-      renderEncoder_->bindDepthStencilState(strokeShapeStencilState_);
+      bindDepthStencilState(strokeShapeStencilState_);
+      bindStencilReferenceState(0);
 
-      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
 
       // Draws anti-aliased fragments.
       setUniforms(call->uboIndex, call->image);
-      renderEncoder_->bindDepthStencilState(strokeAntiAliasStencilState_);
-      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset);
+      bindDepthStencilState(strokeAntiAliasStencilState_);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
 
       // Clears stencil buffer.
       bindRenderPipeline(stencilOnlyPipelineStateTriangleStrip_);
-      renderEncoder_->bindDepthStencilState(strokeClearStencilState_);
-      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset);
-      renderEncoder_->bindDepthStencilState(defaultStencilState_);
+      bindDepthStencilState(strokeClearStencilState_);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
     } else {
       // Draws strokes.
       bindRenderPipeline(pipelineStateTriangleStrip_);
+      bindDepthStencilState(defaultStencilState_);
       setUniforms(call->uboIndex, call->image);
-      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset);
+      renderEncoder_->draw(call->strokeCount, 1, call->strokeOffset, paintInstance_);
     }
   }
 
+  void clearStencil(int offset) {
+    bindScissorRectState(nullptr);
+    bindRenderPipeline(stencilOnlyPipelineStateTriangleStrip_);
+    bindDepthStencilState(strokeClearStencilState_);
+    renderEncoder_->draw(4, 1, offset, paintInstance_);
+    stats_.stencilClears++;
+  }
+
+  void glyphs(Call* call) {
+    bindPipelineState(glyphPipelineState_);
+    bindVertexBufferState((size_t)call->triangleOffset * vertexSize_);
+    bindVertexUniformBufferState();
+    bindDepthStencilState(defaultStencilState_);
+    setUniforms(call->uboIndex, call->image);
+    renderEncoder_->draw(4, call->triangleCount, 0, paintInstance_);
+  }
+
   void triangles(Call* call) {
     bindRenderPipeline(pipelineState_);
+    bindDepthStencilState(defaultStencilState_);
     setUniforms(call->uboIndex, call->image);
-    renderEncoder_->draw(call->triangleCount, 1, call->triangleOffset);
+    renderEncoder_->draw(call->triangleCount, 1, call->triangleOffset, paintInstance_);
   }
 
   void updateRenderPipelineStatesForBlend(Blend* blend) {
-    if (pipelineState_ != nullptr && stencilOnlyPipelineState_ != nullptr &&
-        piplelinePixelFormat_ == framebuffer_->getColorAttachment(0)->getProperties().format &&
-        blendFunc_->srcRGB == blend->srcRGB && blendFunc_->dstRGB == blend->dstRGB &&
-        blendFunc_->srcAlpha == blend->srcAlpha && blendFunc_->dstAlpha == blend->dstAlpha) {
+    PipelineKey key;
+    key.blend = *blend;
+    key.colorFormat = framebuffer_->getColorAttachment(0)->getProperties().format;
+    key.depthFormat = framebuffer_->getDepthAttachment()->getProperties().format;
+    key.stencilFormat = framebuffer_->getStencilAttachment()->getProperties().format;
+    key.topology = igl::PrimitiveType::Triangle;
+    key.colorWriteMask = igl::ColorWriteBits::ColorWriteBitsAll;
+    if (pipelineState_ != nullptr && pipelineKeyEquals(pipelineKey_, key)) {
       return;
     }
 
-    igl::Result result;
+    pipelineKey_ = key;
+    pipelineState_ = findOrCreatePipeline(key);
+    key.topology = igl::PrimitiveType::TriangleStrip;
+    pipelineStateTriangleStrip_ = findOrCreatePipeline(key);
+    key.colorWriteMask = igl::ColorWriteBits::ColorWriteBitsDisabled;
+    stencilOnlyPipelineStateTriangleStrip_ = findOrCreatePipeline(key);
+    key.topology = igl::PrimitiveType::Triangle;
+    stencilOnlyPipelineState_ = findOrCreatePipeline(key);
+    if (glyphInstances_) {
+      glyphPipelineState_ = findOrCreatePipeline(glyphPipelineKey(key));
+    }
+  }
+
+  static PipelineKey glyphPipelineKey(PipelineKey key) {
+    key.topology = igl::PrimitiveType::TriangleStrip;
+    key.colorWriteMask = igl::ColorWriteBits::ColorWriteBitsAll;
+    key.glyphs = true;
+    return key;
+  }
+
+  std::shared_ptr<igl::IRenderPipelineState> findOrCreatePipeline(const PipelineKey& key) {
+    {
+      std::lock_guard<std::mutex> lock(pipelineCacheMutex_);
+      std::shared_ptr<igl::IRenderPipelineState> pipelineState = findPipeline(key);
+      if (pipelineState != nullptr) {
+        return pipelineState;
+      }
+    }
+
+    if (prewarmed_) {
+      IGL_LOG_INFO("iglu::nanovg: pipeline hitch, blend %d %d %d %d, color format %d\n",
+                   (int)key.blend.srcRGB,
+                   (int)key.blend.dstRGB,
+                   (int)key.blend.srcAlpha,
+                   (int)key.blend.dstAlpha,
+                   (int)key.colorFormat);
+      stats_.pipelineHitches++;
+    }
+    return addPipeline(key, createPipeline(key));
+  }
+
+  // Requires pipelineCacheMutex_.
+  std::shared_ptr<igl::IRenderPipelineState> findPipeline(const PipelineKey& key) const {
+    for (const auto& entry : pipelineCache_) {
+      if (pipelineKeyEquals(entry.key, key)) {
+        return entry.pipelineState;
+      }
+    }
+    return nullptr;
+  }
+
+  // Returns the cached pipeline instead if another thread added one for `key` first.
+  std::shared_ptr<igl::IRenderPipelineState> addPipeline(
+      const PipelineKey& key, std::shared_ptr<igl::IRenderPipelineState> pipelineState) {
+    std::lock_guard<std::mutex> lock(pipelineCacheMutex_);
+    std::shared_ptr<igl::IRenderPipelineState> cached = findPipeline(key);
+    if (cached != nullptr) {
+      return cached;
+    }
+    pipelineCache_.push_back({key, pipelineState});
+    stats_.createdPipelines++;
+    return pipelineState;
+  }
+
+  // Creates the pipelines of every key, which differ by topology, write mask and glyphs.
+  void prewarmPipelines(const Vector<PipelineKey>& keys) {
+    for (PipelineKey key : keys) {
+      for (igl::ColorWriteMask colorWriteMask : {igl::ColorWriteBits::ColorWriteBitsAll,
+                                                 igl::ColorWriteBits::ColorWriteBitsDisabled}) {
+        for (igl::PrimitiveType topology :
+             {igl::PrimitiveType::Triangle, igl::PrimitiveType::TriangleStrip}) {
+          key.colorWriteMask = colorWriteMask;
+          key.topology = topology;
+          prewarmPipeline(key);
+        }
+      }
+      if (glyphInstances_) {
+        prewarmPipeline(glyphPipelineKey(key));
+      }
+    }
+  }
+
+  void prewarmPipeline(const PipelineKey& key) {
+    {
+      std::lock_guard<std::mutex> lock(pipelineCacheMutex_);
+      if (findPipeline(key) != nullptr) {
+        return;
+      }
+    }
+    addPipeline(key, createPipeline(key));
+  }
+
+  // Thread-safe, only reads state that is fixed after renderCreate().
+  std::shared_ptr<igl::IRenderPipelineState> createPipeline(const PipelineKey& key) {
+    const bool stencilOnly = key.colorWriteMask == igl::ColorWriteBits::ColorWriteBitsDisabled;
+    const bool triangleStrip = key.topology == igl::PrimitiveType::TriangleStrip;
 
     igl::RenderPipelineDesc pipelineStateDescriptor;
 
@@ -1269,62 +3920,45 @@ class Context {
     pipelineStateDescriptor.targetDesc.colorAttachments.resize(1);
     igl::RenderPipelineDesc::TargetDesc::ColorAttachment& colorAttachmentDescriptor =
         pipelineStateDescriptor.targetDesc.colorAttachments[0];
-    colorAttachmentDescriptor.textureFormat =
-        framebuffer_->getColorAttachment(0)->getProperties().format;
-    pipelineStateDescriptor.targetDesc.stencilAttachmentFormat =
-        framebuffer_->getStencilAttachment()->getProperties().format;
-    pipelineStateDescriptor.targetDesc.depthAttachmentFormat =
-        framebuffer_->getDepthAttachment()->getProperties().format;
-    pipelineStateDescriptor.shaderStages = igl::ShaderStagesCreator::fromRenderModules(
-        *device_, vertexFunction_, fragmentFunction_, &result);
-    IGL_DEBUG_ASSERT(result.isOk());
-
-    pipelineStateDescriptor.vertexInputState =
-        device_->createVertexInputState(vertexDescriptor_, &result);
-    IGL_DEBUG_ASSERT(result.isOk());
+    colorAttachmentDescriptor.textureFormat = key.colorFormat;
+    pipelineStateDescriptor.targetDesc.stencilAttachmentFormat = key.stencilFormat;
+    pipelineStateDescriptor.targetDesc.depthAttachmentFormat = key.depthFormat;
+    if (key.glyphs) {
+      pipelineStateDescriptor.shaderStages = glyphShaderStages_;
+      pipelineStateDescriptor.vertexInputState = glyphVertexInputState_;
+    } else {
+      pipelineStateDescriptor.shaderStages =
+          stencilOnly ? stencilOnlyShaderStages_ : shaderStages_;
+      pipelineStateDescriptor.vertexInputState = vertexInputState_;
+    }
 
     // Sets blending states.
     colorAttachmentDescriptor.blendEnabled = true;
-    colorAttachmentDescriptor.srcRGBBlendFactor = blend->srcRGB;
-    colorAttachmentDescriptor.srcAlphaBlendFactor = blend->srcAlpha;
-    colorAttachmentDescriptor.dstRGBBlendFactor = blend->dstRGB;
-    colorAttachmentDescriptor.dstAlphaBlendFactor = blend->dstAlpha;
-    blendFunc_->srcRGB = blend->srcRGB;
-    blendFunc_->dstRGB = blend->dstRGB;
-    blendFunc_->srcAlpha = blend->srcAlpha;
-    blendFunc_->dstAlpha = blend->dstAlpha;
-
-    pipelineStateDescriptor.topology = igl::PrimitiveType::Triangle;
-    pipelineStateDescriptor.cullMode = igl::CullMode::Disabled;
-    pipelineStateDescriptor.debugName = igl::genNameHandle("Triangle_CullNone");
-    pipelineState_ = device_->createRenderPipeline(pipelineStateDescriptor, &result);
-
-    pipelineStateDescriptor.topology = igl::PrimitiveType::TriangleStrip;
-    pipelineStateDescriptor.cullMode = igl::CullMode::Back;
-    pipelineStateDescriptor.debugName = igl::genNameHandle("TriangleStripe_CullBack");
-    pipelineStateTriangleStrip_ = device_->createRenderPipeline(pipelineStateDescriptor, &result);
-    IGL_DEBUG_ASSERT(result.isOk());
-
-    auto fragmentFunction =
-        device_->getBackendType() == igl::BackendType::Metal ? nullptr : fragmentFunction_;
-    pipelineStateDescriptor.shaderStages = igl::ShaderStagesCreator::fromRenderModules(
-        *device_, vertexFunction_, fragmentFunction, &result);
-
-    IGL_DEBUG_ASSERT(result.isOk());
-    colorAttachmentDescriptor.colorWriteMask = igl::ColorWriteBits::ColorWriteBitsDisabled;
-    pipelineStateDescriptor.cullMode = igl::CullMode::Disabled;
-    pipelineStateDescriptor.topology = igl::PrimitiveType::Triangle;
-    pipelineStateDescriptor.debugName = igl::genNameHandle("stencilOnlyPipelineState");
-    stencilOnlyPipelineState_ = device_->createRenderPipeline(pipelineStateDescriptor, &result);
-    IGL_DEBUG_ASSERT(result.isOk());
+    colorAttachmentDescriptor.srcRGBBlendFactor = key.blend.srcRGB;
+    colorAttachmentDescriptor.srcAlphaBlendFactor = key.blend.srcAlpha;
+    colorAttachmentDescriptor.dstRGBBlendFactor = key.blend.dstRGB;
+    colorAttachmentDescriptor.dstAlphaBlendFactor = key.blend.dstAlpha;
+    colorAttachmentDescriptor.colorWriteMask = key.colorWriteMask;
+
+    pipelineStateDescriptor.topology = key.topology;
+    pipelineStateDescriptor.cullMode = triangleStrip && !stencilOnly && !key.glyphs
+                                           ? igl::CullMode::Back
+                                           : igl::CullMode::Disabled;
+    if (key.glyphs) {
+      pipelineStateDescriptor.debugName = igl::genNameHandle("Glyphs_CullNone");
+    } else if (stencilOnly) {
+      pipelineStateDescriptor.debugName = igl::genNameHandle(
+          triangleStrip ? "stencilOnlyPipelineStateTriangleStrip" : "stencilOnlyPipelineState");
+    } else {
+      pipelineStateDescriptor.debugName =
+          igl::genNameHandle(triangleStrip ? "TriangleStripe_CullBack" : "Triangle_CullNone");
+    }
 
-    pipelineStateDescriptor.debugName = igl::genNameHandle("stencilOnlyPipelineStateTriangleStrip");
-    pipelineStateDescriptor.topology = igl::PrimitiveType::TriangleStrip;
-    stencilOnlyPipelineStateTriangleStrip_ =
+    igl::Result result;
+    std::shared_ptr<igl::IRenderPipelineState> pipelineState =
         device_->createRenderPipeline(pipelineStateDescriptor, &result);
     IGL_DEBUG_ASSERT(result.isOk());
-
-    piplelinePixelFormat_ = framebuffer_->getColorAttachment(0)->getProperties().format;
+    return pipelineState;
   }
 };
 
@@ -1431,14 +4065,43 @@ void SetRenderCommandEncoder(NVGcontext* ctx,
   mtl->framebuffer_ = framebuffer;
   mtl->renderEncoder_ = command;
   if (matrix) {
-    memcpy(&mtl->curBuffers_->vertexUniforms.matrix, matrix, sizeof(float) * 16);
+    memcpy(&mtl->vertexMatrix_, matrix, sizeof(float) * 16);
+    if (mtl->curBuffers_) {
+      mtl->curBuffers_->vertexUniforms.matrix = mtl->vertexMatrix_;
+    }
   }
 }
 
 NVGcontext* CreateContext(igl::IDevice* device, int flags) {
+  return CreateContext(device, flags, ContextOptions());
+}
+
+// Whether indirect draws of `device` may start at a non-zero instance. IGL has no device feature
+// for it, Vulkan only honors firstInstance with drawIndirectFirstInstance enabled.
+static bool hasIndirectFirstInstance(igl::IDevice* device) {
+#if IGL_BACKEND_VULKAN
+  if (device->getBackendType() == igl::BackendType::Vulkan) {
+    const igl::vulkan::VulkanContext& context =
+        static_cast<igl::vulkan::Device*>(device)->getVulkanContext();
+    return context.features().vkPhysicalDeviceFeatures2.features.drawIndirectFirstInstance ==
+           VK_TRUE;
+  }
+#endif
+  return false;
+}
+
+NVGcontext* CreateContext(igl::IDevice* device, int flags, const ContextOptions& options) {
   NVGparams params;
   NVGcontext* ctx = NULL;
-  Context* mtl = new Context();
+  // Blocks must be released by the deallocate() matching the allocate() that returned them.
+  if ((options.allocator.allocate == nullptr) != (options.allocator.deallocate == nullptr)) {
+    IGL_DEBUG_ASSERT(false, "Allocator needs both callbacks or neither");
+    return NULL;
+  }
+  void* memory = allocateMemory(&options.allocator, sizeof(Context));
+  if (memory == NULL)
+    return NULL;
+  Context* mtl = new (memory) Context(options.allocator);
 
   memset(&params, 0, sizeof(params));
   params.renderCreate = callback__renderCreate;
@@ -1457,6 +4120,18 @@ NVGcontext* CreateContext(igl::IDevice* device, int flags) {
   params.edgeAntiAlias = flags & NVG_ANTIALIAS ? 1 : 0;
 
   mtl->flags_ = flags;
+  mtl->maxFramesInFlight_ = std::clamp(options.framesInFlight, 2, 4);
+  for (int i = mtl->maxFramesInFlight_; i--;) {
+    mtl->submissions_.emplace_back(&mtl->allocator_);
+  }
+  mtl->usageHint_.calls = options.callCountHint;
+  mtl->usageHint_.verts = options.vertexCountHint;
+  mtl->usageHint_.indexes = options.indexCountHint;
+  mtl->triangulateMaxVertices_ =
+      std::clamp(options.triangulateMaxVertices, 0, kMaxTriangulatedVertices);
+  mtl->vertexSize_ = (flags & NVG_COMPACT_VERTICES) ? sizeof(CompactVertex) : sizeof(NVGvertex);
+  mtl->compactPositionFactor_ =
+      (float)(1 << std::clamp(options.compactVertexFractionBits, 0, 8));
 
   device->getFeatureLimits(igl::DeviceFeatureLimits::MaxUniformBufferBytes,
                            mtl->maxUniformBufferSize_);
@@ -1465,33 +4140,115 @@ NVGcontext* CreateContext(igl::IDevice* device, int flags) {
 
   size_t uniformBufferAlignment = 16;
   device->getFeatureLimits(igl::DeviceFeatureLimits::BufferAlignment, uniformBufferAlignment);
-  // sizeof(MNVGfragUniforms)= 176
-  // 64 * 3 > 176
-  mtl->fragmentUniformBufferSize_ = std::max(64 * 3, (int)uniformBufferAlignment);
+  mtl->fragmentUniformBufferSize_ = std::max(sizeof(FragmentUniforms), uniformBufferAlignment);
+  mtl->uniformBufferAlignment_ = uniformBufferAlignment;
+  size_t maxPushConstantBytes = 0;
+  mtl->pushConstants_ =
+      (flags & NVG_PUSH_CONSTANTS) && device->getBackendType() == igl::BackendType::Vulkan &&
+      device->getFeatureLimits(igl::DeviceFeatureLimits::MaxPushConstantBytes,
+                               maxPushConstantBytes) &&
+      maxPushConstantBytes >= sizeof(FragmentUniforms);
+  // OpenGL has no base instance in the shader before GLSL 4.60, it keeps uniform buffers.
+  const igl::BackendType backendType = device->getBackendType();
+  mtl->paintTable_ = (flags & NVG_PAINT_TABLE) && !mtl->pushConstants_ &&
+                     (backendType == igl::BackendType::Vulkan ||
+                      backendType == igl::BackendType::Metal) &&
+                     device->hasFeature(igl::DeviceFeatures::StorageBuffers);
+  // Instance attributes would be offset by the base instance, which selects the paint.
+  mtl->glyphInstances_ = (flags & NVG_GLYPH_INSTANCES) && !mtl->paintTable_;
+  // Multi-draws select the paint of each draw with its base instance, which needs the paint table.
+  // The base instance is the firstInstance of the indirect draws: without the device feature it
+  // must be zero, and every fill of a run would read the first paint.
+  mtl->multiDrawFills_ = mtl->paintTable_ && backendType == igl::BackendType::Vulkan &&
+                         device->hasFeature(igl::DeviceFeatures::MultiDrawIndirect) &&
+                         hasIndirectFirstInstance(device);
+  mtl->rollingStencilRefs_ =
+      (flags & NVG_STENCIL_STROKES) && (flags & NVG_ROLLING_STENCIL_REFS);
+  mtl->batchFills_ = (flags & NVG_BATCH_FILLS) && !mtl->multiDrawFills_;
+  mtl->scissorRects_ = flags & NVG_SCISSOR_RECTS;
+  mtl->callBounds_ = (flags & NVG_SORT_CALLS) || mtl->multiDrawFills_ ||
+                     mtl->rollingStencilRefs_ || mtl->batchFills_;
+  if (mtl->pushConstants_ || mtl->paintTable_) {
+    // Blocks are not bound at offsets, paint table entries are indexed by their offset.
+    mtl->fragmentUniformBufferSize_ = sizeof(FragmentUniforms);
+  }
+  // One fragment uniform block per call.
+  mtl->usageHint_.uniformBytes = options.callCountHint * mtl->fragmentUniformBufferSize_;
 
-  mtl->indexSize_ = 4; // IndexType::UInt32
   mtl->device_ = device;
 
   ctx = nvgCreateInternal(&params);
   if (ctx == NULL)
     goto error;
+
+  if (!options.prewarmFormats.empty()) {
+    Vector<PipelineKey> keys{StlAllocator<PipelineKey>(&mtl->allocator_)};
+    for (const FramebufferFormats& formats : options.prewarmFormats) {
+      for (int op = NVG_SOURCE_OVER; op <= NVG_XOR; op++) {
+        const std::vector<int>& ops = options.prewarmCompositeOperations;
+        if (!ops.empty() && std::find(ops.begin(), ops.end(), op) == ops.end()) {
+          continue;
+        }
+        PipelineKey key;
+        key.blend = mtl->blendCompositeOperation(compositeOperationState(op));
+        key.colorFormat = formats.color;
+        key.depthFormat = formats.depth;
+        key.stencilFormat = formats.stencil;
+        keys.push_back(key);
+      }
+    }
+    mtl->prewarmed_ = true;
+    // MTLDevice is documented as thread-safe, IGL does not promise it for other backends.
+    // An OpenGL context is only current on the thread that created it. On Vulkan, IGL still
+    // compiles the VkPipeline at its first draw; creating the pipeline state here does the
+    // rest of the work, its shader reflection and descriptor set layouts.
+    if (options.prewarmInBackground && device->getBackendType() == igl::BackendType::Metal) {
+      mtl->prewarmThread_ = std::thread(
+          [mtl, keys = std::move(keys)]() { mtl->prewarmPipelines(keys); });
+    } else {
+      mtl->prewarmPipelines(keys);
+    }
+  }
   return ctx;
 
 error:
-  if (ctx != NULL)
-    nvgDeleteInternal(ctx);
+  // nvgCreateInternal() already called renderDelete(), the context itself is still allocated.
+  {
+    const Allocator allocator = mtl->allocator_;
+    mtl->~Context();
+    deallocateMemory(&allocator, mtl, sizeof(Context));
+  }
   return NULL;
 }
 
+void SetCommandBuffer(NVGcontext* ctx, const std::shared_ptr<igl::ICommandBuffer>& commandBuffer) {
+  Context* mtl = (Context*)nvgInternalParams(ctx)->userPtr;
+  mtl->commandBuffer_ = commandBuffer;
+}
+
+void GetRenderStats(NVGcontext* ctx, RenderStats* stats) {
+  Context* mtl = (Context*)nvgInternalParams(ctx)->userPtr;
+  std::lock_guard<std::mutex> lock(mtl->pipelineCacheMutex_);
+  *stats = mtl->stats_;
+}
+
+void ResetRenderStats(NVGcontext* ctx) {
+  Context* mtl = (Context*)nvgInternalParams(ctx)->userPtr;
+  std::lock_guard<std::mutex> lock(mtl->pipelineCacheMutex_);
+  mtl->stats_ = RenderStats();
+}
+
 void DestroyContext(NVGcontext* ctx) {
   if (!ctx)
     return;
+  // The context is released last, nvgDeleteInternal() still calls into it.
+  Context* mtl = (Context*)nvgInternalParams(ctx)->userPtr;
   nvgDeleteInternal(ctx);
 
-  if (auto param = nvgInternalParams(ctx)) {
-    if (param->userPtr) {
-      delete (Context*)param->userPtr;
-    }
+  if (mtl) {
+    const Allocator allocator = mtl->allocator_;
+    mtl->~Context();
+    deallocateMemory(&allocator, mtl, sizeof(Context));
   }
 }
 
@@ -20,6 +20,7 @@
 #pragma once
 #include "nanovg.h"
 #include <igl/IGL.h>
+#include <vector>
 
 namespace iglu::nanovg {
 
@@ -42,6 +43,76 @@ enum NVGcreateFlags {
    * Flag indicating that additional debug checks are done.
    */
   NVG_DEBUG = 1 << 2,
+  /*
+   * Flag indicating that vertex, index and uniform data are sub-allocated from long-lived
+   * ring buffers shared by all frames, instead of per-frame buffers that are recreated on growth.
+   * On Metal and Vulkan, vertices and indexes are written straight into the mapped ring buffers.
+   * Fragment uniforms, and on OpenGL everything, are staged on the CPU and copied at flush.
+   */
+  NVG_RING_BUFFERS = 1 << 3,
+  /*
+   * Flag indicating that vertices are stored in 8 bytes instead of 16: positions as 16-bit
+   * fixed-point numbers and texture coordinates as 16-bit normalized numbers.
+   * See ContextOptions::compactVertexFractionBits for the precision and range of positions.
+   */
+  NVG_COMPACT_VERTICES = 1 << 4,
+  /*
+   * Flag indicating that on Vulkan the paint uniforms of every draw are delivered as push
+   * constants instead of a uniform buffer binding. Ignored on other backends, which keep the
+   * uniform buffer path.
+   */
+  NVG_PUSH_CONSTANTS = 1 << 5,
+  /*
+   * Flag indicating that the paint uniforms of a frame are uploaded into one storage buffer and
+   * every draw selects its paint with its base instance, instead of binding a uniform buffer
+   * per draw. Vulkan and Metal only, ignored with NVG_PUSH_CONSTANTS and on devices without
+   * storage buffers; OpenGL and OpenGL ES keep the uniform buffer path.
+   * On Vulkan devices with multi-draw indirect and drawIndirectFirstInstance enabled, runs of
+   * consecutive fills that do not overlap and share a texture and blend are also drawn with one
+   * indirect multi-draw per pass.
+   */
+  NVG_PAINT_TABLE = 1 << 6,
+  /*
+   * Flag indicating that text is drawn as one 24-byte instance per glyph, expanded into a quad
+   * by the vertex shader, instead of six vertices per glyph. Glyphs that are not axis-aligned,
+   * e.g. of rotated text, keep using vertices. Ignored with NVG_PAINT_TABLE.
+   */
+  NVG_GLYPH_INSTANCES = 1 << 7,
+  /*
+   * Flag indicating that calls are reordered before drawing, so that calls with the same
+   * pipeline and texture are drawn together. A call is only moved before calls whose bounds do
+   * not overlap its own, so the rendered output does not change.
+   */
+  NVG_SORT_CALLS = 1 << 8,
+  /*
+   * Flag indicating that solid color fills of axis-aligned rects, rounded rects, circles and
+   * ellipses are drawn as one quad with analytic anti-aliasing from their signed distance,
+   * instead of their tessellation and fringe. Only applies with composite operations that keep
+   * the destination where the source is transparent, e.g. the default NVG_SOURCE_OVER.
+   */
+  NVG_ANALYTIC_SHAPES = 1 << 9,
+  /*
+   * Flag indicating that NVG_STENCIL_STROKES strokes write a stencil reference of their own,
+   * incremented per stroke, instead of clearing the stencil with a third pass. The stencil is
+   * zeroed by one quad over the strokes since the last clear, before the next stencil fill,
+   * after 255 strokes and at the end of the frame. Ignored without NVG_STENCIL_STROKES.
+   */
+  NVG_ROLLING_STENCIL_REFS = 1 << 10,
+  /*
+   * Flag indicating that runs of consecutive fills that do not overlap and share a paint and
+   * blend draw one stencil pass and one cover pass for the whole run, instead of both per fill.
+   * Anti-aliased fringes are still drawn per fill. Ignored where NVG_PAINT_TABLE multi-draws
+   * fills, which batches them already.
+   */
+  NVG_BATCH_FILLS = 1 << 11,
+  /*
+   * Flag indicating that calls whose scissor is an axis-aligned rectangle with edges on pixel
+   * boundaries are clipped by the scissor rect of the render command encoder, and skip the
+   * scissor mask in the fragment shader. Calls that the scissor clips entirely are dropped
+   * before they are recorded. Only applies while the matrix of SetRenderCommandEncoder() is
+   * the identity, as it is when none is given.
+   */
+  NVG_SCISSOR_RECTS = 1 << 12,
 };
 
 /*
@@ -54,10 +125,199 @@ enum NVGimageFlags {
   NVG_IMAGE_NODELETE = 1 << 16,
 };
 
+/*
+ * CPU memory callbacks used by this IGL backend instead of malloc() and free(). They only
+ * cover backend allocations: the nanovg core (nanovg.c) and IGL keep allocating with their
+ * own allocators. The backend itself still uses the default heap for:
+ * - the std::string and std::vector members of IGL descriptors and shader module infos that
+ *   CreateContext() and pipeline creation pass to IGL;
+ * - the std::thread of ContextOptions::prewarmInBackground.
+ * None of these are allocated by frames once their pipelines exist.
+ * `allocate` returns null on failure and its memory must be aligned like malloc(). The backend
+ * does not recover from a failure: it throws std::bad_alloc out of the nanovg call, as the
+ * standard library does when malloc() fails.
+ * `deallocate` receives the size that was passed to `allocate`.
+ * Both callbacks must be set, or neither; CreateContext() fails otherwise.
+ */
+struct Allocator {
+  void* (*allocate)(void* userData, size_t size) = nullptr;
+  void (*deallocate)(void* userData, void* ptr, size_t size) = nullptr;
+  void* userData = nullptr;
+};
+
+/*
+ * Attachment formats of a framebuffer that the context renders into.
+ */
+struct FramebufferFormats {
+  igl::TextureFormat color = igl::TextureFormat::Invalid;
+  igl::TextureFormat depth = igl::TextureFormat::Invalid;
+  igl::TextureFormat stencil = igl::TextureFormat::Invalid;
+};
+
+/*
+ * Additional options for CreateContext().
+ */
+struct ContextOptions {
+  /*
+   * Number of submissions (command buffers passed to SetCommandBuffer) whose buffers may be in
+   * flight on the GPU at the same time, clamped to [2, 4]. More submissions trade latency for
+   * throughput under GPU backpressure.
+   */
+  int framesInFlight = 3;
+  /*
+   * Expected number of calls, vertices and indexes per frame. Every frame's buffers are
+   * reserved for at least these sizes, in addition to the high-water mark of recent frames.
+   */
+  int callCountHint = 0;
+  int vertexCountHint = 0;
+  int indexCountHint = 0;
+  /*
+   * Number of fractional bits of NVG_COMPACT_VERTICES positions, clamped to [0, 8].
+   * The default of 3 gives a precision of 1/8 unit and a range of [-4096, 4096] units;
+   * positions outside of the range are clamped.
+   */
+  int compactVertexFractionBits = 3;
+  /*
+   * Allocator of the backend's CPU memory only: the context, buffer sets, frame staging,
+   * uniform blocks and bookkeeping. Null callbacks fall back to malloc() and free().
+   * The nanovg core allocates its path cache, states and font atlas with malloc() directly,
+   * and IGL its objects with its own allocator; neither goes through this allocator. See
+   * Allocator for what the backend allocates elsewhere.
+   */
+  Allocator allocator;
+  /*
+   * Framebuffer formats and composite operations (NVGcompositeOperation values) whose render
+   * pipelines are created by CreateContext() instead of by the first frame that uses them.
+   * Every composite operation is combined with every format; no composite operations means all
+   * of them. Pipelines that are still created by a frame afterwards are logged as hitches.
+   * On Vulkan, IGL compiles the VkPipeline itself when it is first drawn with, pre-warming only
+   * creates the pipeline states around it.
+   */
+  std::vector<FramebufferFormats> prewarmFormats;
+  std::vector<int> prewarmCompositeOperations;
+  /*
+   * Create the pipelines of `prewarmFormats` on a background thread, so that CreateContext()
+   * does not wait for them. Frames that need a pipeline before it is ready create it themselves.
+   * Metal only, OpenGL and Vulkan create them on the calling thread before CreateContext()
+   * returns.
+   */
+  bool prewarmInBackground = false;
+  /*
+   * Maximum number of points, clamped to [0, 256], of a single concave path whose fill is
+   * triangulated on the CPU and drawn without the stencil passes. Paths that are not simple,
+   * i.e. self-intersecting, and paths with holes keep using the stencil. Zero disables it.
+   * Triangulation cost grows quadratically with the points, while the stencil passes cost fill
+   * rate over the path's bounds: the break-even point depends on the device, measure it with
+   * RenderStats::triangulatedFills and frame times. 32 is a reasonable start for UI shapes.
+   */
+  int triangulateMaxVertices = 0;
+};
+
+/*
+ * Counters accumulated by the backend since the context was created or last reset.
+ */
+struct RenderStats {
+  /*
+   * Number of flushed frames.
+   */
+  uint64_t frames = 0;
+  /*
+   * Number of GPU buffers created by the backend.
+   */
+  uint64_t createdBuffers = 0;
+  /*
+   * Number of bytes uploaded to vertex, index and uniform buffers.
+   */
+  uint64_t uploadedBytes = 0;
+  /*
+   * Number of times the CPU waited for the GPU to release a frame's buffers.
+   */
+  uint64_t gpuWaits = 0;
+  /*
+   * Number of times a call, vertex, index or uniform pool had to grow while a frame was being
+   * recorded. Stays at zero in steady state.
+   */
+  uint64_t frameGrowths = 0;
+  /*
+   * Number of CPU heap blocks the backend allocated for frame data, counted where it allocates
+   * them: Buffers sets, their call and vertex/index arenas, fragment uniform staging blocks and
+   * uniform dedup tables. Other allocations of the backend, e.g. textures and pipelines, and
+   * those of the nanovg core and IGL are not counted. Stays at zero in steady state.
+   */
+  uint64_t heapAllocations = 0;
+  /*
+   * Number of fragment uniform blocks that were identical to an earlier block of the same frame
+   * and shared its slot instead of being written and uploaded again.
+   */
+  uint64_t sharedUniformBlocks = 0;
+  /*
+   * Number of calls that were drawn as part of the previous call, because they continue its
+   * vertices or indexes with the same pipeline, texture and paint. Only calls with identical
+   * paints merge, e.g. runs of text or shapes of one color; differently painted calls are drawn
+   * separately even with NVG_PAINT_TABLE.
+   */
+  uint64_t mergedCalls = 0;
+  /*
+   * Number of pipeline, depth-stencil, buffer, texture and sampler binds that were skipped
+   * because the render command encoder already had that state bound.
+   */
+  uint64_t elidedBinds = 0;
+  /*
+   * Number of render pipelines created by the backend. Pipelines are cached for the lifetime of
+   * the context, so this stops growing once every blend mode and framebuffer format in use has
+   * been drawn with.
+   */
+  uint64_t createdPipelines = 0;
+  /*
+   * Number of render pipelines that a frame had to create although pipelines were pre-warmed,
+   * see ContextOptions::prewarmFormats. Each one is also logged. On Vulkan, the first draw
+   * with a pre-warmed pipeline still compiles it inside IGL without counting as a hitch.
+   */
+  uint64_t pipelineHitches = 0;
+  /*
+   * Number of glyphs drawn as instances, see NVG_GLYPH_INSTANCES.
+   */
+  uint64_t instancedGlyphs = 0;
+  /*
+   * Number of calls that NVG_SORT_CALLS moved next to a call with the same state. Together with
+   * mergedCalls and elidedBinds it measures the draws and state changes that were saved.
+   */
+  uint64_t reorderedCalls = 0;
+  /*
+   * Number of fills drawn with indirect multi-draws, see NVG_PAINT_TABLE.
+   */
+  uint64_t multiDrawFills = 0;
+  /*
+   * Number of fills drawn as analytic shapes, see NVG_ANALYTIC_SHAPES.
+   */
+  uint64_t analyticFills = 0;
+  /*
+   * Number of concave fills that were triangulated, see ContextOptions::triangulateMaxVertices.
+   */
+  uint64_t triangulatedFills = 0;
+  /*
+   * Number of stencil clears drawn for NVG_ROLLING_STENCIL_REFS, each replaces the clear passes
+   * of the strokes drawn since the previous one.
+   */
+  uint64_t stencilClears = 0;
+  /*
+   * Number of fills drawn in the stencil and cover passes of a preceding fill, see
+   * NVG_BATCH_FILLS.
+   */
+  uint64_t batchedFills = 0;
+  /*
+   * Number of calls clipped by the encoder's scissor rect, and of calls dropped because their
+   * scissor clips them entirely, see NVG_SCISSOR_RECTS.
+   */
+  uint64_t hardwareScissorCalls = 0;
+  uint64_t rejectedCalls = 0;
+};
+
 /*
  * Creates a new NanoVG context.  The `flags` should be combination of `NVGcreateFlags` above.
  */
 NVGcontext* CreateContext(igl::IDevice* device, int flags);
+NVGcontext* CreateContext(igl::IDevice* device, int flags, const ContextOptions& options);
 
 /*
  * Set RenderCommandEncoder form outside.
@@ -68,6 +328,30 @@ void SetRenderCommandEncoder(NVGcontext* ctx,
                              igl::IRenderCommandEncoder*,
                              float* matrix);
 
+/*
+ * Set the command buffer that the current frame is encoded into, after nvgBeginFrame().
+ * Any number of nvgBeginFrame/nvgEndFrame cycles may be encoded into the same command buffer,
+ * each gets its own buffers. The buffers stay reserved until that command buffer completes,
+ * the backend waits for it before reusing them. Without a command buffer, every frame is
+ * treated as its own submission and its buffers are reused after `framesInFlight` frames
+ * without waiting.
+ * The backend does not wait for a command buffer that may still be encoded into: the one of
+ * the current frame, and the one of the latest frame when earlier frames used it as well, e.g.
+ * while several command buffers are recorded in turns. Frames get new buffers instead, until it
+ * can be waited for. Other command buffers must be committed in the order they were set.
+ */
+void SetCommandBuffer(NVGcontext* ctx, const std::shared_ptr<igl::ICommandBuffer>& commandBuffer);
+
+/*
+ * Copies the backend counters of the context into `stats`.
+ */
+void GetRenderStats(NVGcontext* ctx, RenderStats* stats);
+
+/*
+ * Resets the backend counters of the context to zero.
+ */
+void ResetRenderStats(NVGcontext* ctx);
+
 /*
  * Deletes the specified NanoVG context.
  */
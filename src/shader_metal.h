@@ -5,6 +5,7 @@
  * LICENSE file in the root directory of this source tree.
  */
 #pragma once
+#include "shader_uniforms.h"
 #include <string>
 
 namespace iglu::nanovg {
@@ -20,39 +21,46 @@ typedef struct {
   float2 tcoord [[attribute(1)]];
 } Vertex;
 
+typedef struct {
+  float4 rect [[attribute(0)]];
+  float4 uvRect [[attribute(1)]];
+} GlyphInstance;
+
 typedef struct {
   float4 pos  [[position]];
   float2 fpos;
   float2 ftcoord;
+  uint paintIndex [[flat]];
 } RasterizerData;
 
 typedef struct  {
   float4x4 matrix;
   float2 viewSize;
+  float positionScale;
 } VertexUniforms;
 
 typedef struct  {
-  float3x3 scissorMat;
-  float3x3 paintMat;
-  float4 innerCol;
-  float4 outerCol;
-  float2 scissorExt;
-  float2 scissorScale;
-  float2 extent;
-  float radius;
-  float feather;
-  float strokeMult;
-  float strokeThr;
-  int texType;
-  int type;
-} FragmentUniforms;
+)" NVG_METAL_FRAGMENT_UNIFORM_FIELDS R"(} FragmentUniforms;
+
+float2 scissorTransform(constant FragmentUniforms& uniforms, float2 p) {
+  return float2x2(uniforms.scissorMat.xy, uniforms.scissorMat.zw) * p + uniforms.translate.xy;
+}
+
+float2 paintTransform(constant FragmentUniforms& uniforms, float2 p) {
+  return float2x2(uniforms.paintMat.xy, uniforms.paintMat.zw) * p + uniforms.translate.zw;
+}
 
 float scissorMask(constant FragmentUniforms& uniforms, float2 p);
 float sdroundrect(constant FragmentUniforms& uniforms, float2 pt);
+float sdellipse(constant FragmentUniforms& uniforms, float2 pt);
 float strokeMask(constant FragmentUniforms& uniforms, float2 ftcoord);
 
 float scissorMask(constant FragmentUniforms& uniforms, float2 p) {
-  float2 sc = (abs((uniforms.scissorMat * float3(p, 1.0f)).xy)
+  // Negative extents: no scissor, or clipped by the scissor rect of the draw.
+  if (uniforms.scissorExt.x < 0.0) {
+    return 1.0;
+  }
+  float2 sc = (abs(scissorTransform(uniforms, p))
                   - uniforms.scissorExt) \
               * uniforms.scissorScale;
   sc = saturate(float2(0.5f) - sc);
@@ -65,41 +73,52 @@ float sdroundrect(constant FragmentUniforms& uniforms, float2 pt) {
   return min(max(d.x, d.y), 0.0) + length(max(d, 0.0)) - uniforms.radius;
 }
 
+float sdellipse(constant FragmentUniforms& uniforms, float2 pt) {
+  float2 r = uniforms.extent;
+  float k0 = length(pt / r);
+  float k1 = length(pt / (r * r));
+  return k1 > 0.0 ? k0 * (k0 - 1.0) / k1 : -min(r.x, r.y);
+}
+
 float strokeMask(constant FragmentUniforms& uniforms, float2 ftcoord) {
   return min(1.0, (1.0 - abs(ftcoord.x * 2.0 - 1.0)) * uniforms.strokeMult) \
          * min(1.0, ftcoord.y);
 }
 
-// Vertex Function
-vertex RasterizerData vertexShader(Vertex vert [[stage_in]],
-                                   constant VertexUniforms& uniforms [[buffer(1)]]) {
+RasterizerData transformVertex(Vertex vert, constant VertexUniforms& uniforms) {
   RasterizerData out;
+  out.paintIndex = 0;
   out.ftcoord = vert.tcoord;
-  out.fpos = vert.pos;
-  out.pos = float4(2.0 * vert.pos.x / uniforms.viewSize.x - 1.0,
-                   1.0 - 2.0 * vert.pos.y / uniforms.viewSize.y,
+  out.fpos = vert.pos * uniforms.positionScale;
+  out.pos = float4(2.0 * out.fpos.x / uniforms.viewSize.x - 1.0,
+                   1.0 - 2.0 * out.fpos.y / uniforms.viewSize.y,
                    0, 1);
   out.pos = uniforms.matrix * out.pos;
   return out;
 }
 
-// Fragment function (No AA)
-fragment float4 fragmentShader(RasterizerData in [[stage_in]],
-                               constant FragmentUniforms& uniforms [[buffer(2)]],
-                               texture2d<float> texture [[texture(0)]],
-                               sampler sampler [[sampler(0)]]) {
+float4 shade(constant FragmentUniforms& uniforms,
+             RasterizerData in,
+             texture2d<float> texture,
+             sampler sampler) {
   float scissor = scissorMask(uniforms, in.fpos);
   if (scissor == 0)
     return float4(0);
 
   if (uniforms.type == 0) {  // MNVG_SHADER_FILLGRAD
-    float2 pt = (uniforms.paintMat * float3(in.fpos, 1.0)).xy;
+    float2 pt = paintTransform(uniforms, in.fpos);
     float d = saturate((uniforms.feather * 0.5 + sdroundrect(uniforms, pt))
                        / uniforms.feather);
     float4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
     return color * scissor;
+  } else if (uniforms.type == 3) {  // MNVG_SHADER_FILLELLIPSE
+    float2 pt = paintTransform(uniforms, in.fpos);
+    float d = saturate((uniforms.feather * 0.5 + sdellipse(uniforms, pt))
+                       / uniforms.feather);
+    float4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
+    return color * scissor;
   } else if (uniforms.type == 1) {  // MNVG_SHADER_FILLIMG
-    float2 pt = (uniforms.paintMat * float3(in.fpos, 1.0)).xy / uniforms.extent;
+    float2 pt = paintTransform(uniforms, in.fpos) / uniforms.extent;
     float4 color = texture.sample(sampler, pt);
     if (uniforms.texType == 1)
       color = float4(color.xyz * color.w, color.w);
@@ -118,11 +137,10 @@ fragment float4 fragmentShader(RasterizerData in [[stage_in]],
   }
 }
 
-// Fragment function (AA)
-fragment float4 fragmentShaderAA(RasterizerData in [[stage_in]],
-                                 constant FragmentUniforms& uniforms [[buffer(2)]],
-                                 texture2d<float> texture [[texture(0)]],
-                                 sampler sampler [[sampler(0)]]) {
+float4 shadeAA(constant FragmentUniforms& uniforms,
+               RasterizerData in,
+               texture2d<float> texture,
+               sampler sampler) {
   float scissor = scissorMask(uniforms, in.fpos);
   if (scissor == 0)
     return float4(0);
@@ -143,15 +161,23 @@ fragment float4 fragmentShaderAA(RasterizerData in [[stage_in]],
   }
 
   if (uniforms.type == 0) {  // MNVG_SHADER_FILLGRAD
-    float2 pt = (uniforms.paintMat * float3(in.fpos, 1.0)).xy;
+    float2 pt = paintTransform(uniforms, in.fpos);
     float d = saturate((uniforms.feather * 0.5 + sdroundrect(uniforms, pt))
                         / uniforms.feather);
     float4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
     color *= scissor;
     color *= strokeAlpha;
     return color;
+  } else if (uniforms.type == 3) {  // MNVG_SHADER_FILLELLIPSE
+    float2 pt = paintTransform(uniforms, in.fpos);
+    float d = saturate((uniforms.feather * 0.5 + sdellipse(uniforms, pt))
+                        / uniforms.feather);
+    float4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
+    color *= scissor;
+    color *= strokeAlpha;
+    return color;
   } else {  // MNVG_SHADER_FILLIMG
-    float2 pt = (uniforms.paintMat * float3(in.fpos, 1.0)).xy / uniforms.extent;
+    float2 pt = paintTransform(uniforms, in.fpos) / uniforms.extent;
     float4 color = texture.sample(sampler, pt);
     if (uniforms.texType == 1)
       color = float4(color.xyz * color.w, color.w);
@@ -162,6 +188,67 @@ fragment float4 fragmentShaderAA(RasterizerData in [[stage_in]],
     return color * uniforms.innerCol;
   }
 }
+
+// Vertex Function
+vertex RasterizerData vertexShader(Vertex vert [[stage_in]],
+                                   constant VertexUniforms& uniforms [[buffer(1)]]) {
+  return transformVertex(vert, uniforms);
+}
+
+// Fragment function (No AA)
+fragment float4 fragmentShader(RasterizerData in [[stage_in]],
+                               constant FragmentUniforms& uniforms [[buffer(2)]],
+                               texture2d<float> texture [[texture(0)]],
+                               sampler sampler [[sampler(0)]]) {
+  return shade(uniforms, in, texture, sampler);
+}
+
+// Fragment function (AA)
+fragment float4 fragmentShaderAA(RasterizerData in [[stage_in]],
+                                 constant FragmentUniforms& uniforms [[buffer(2)]],
+                                 texture2d<float> texture [[texture(0)]],
+                                 sampler sampler [[sampler(0)]]) {
+  return shadeAA(uniforms, in, texture, sampler);
+}
+
+// Glyph instance vertex function: the vertex index selects the corner of the glyph quad.
+vertex RasterizerData glyphVertexShader(GlyphInstance glyph [[stage_in]],
+                                        constant VertexUniforms& uniforms [[buffer(1)]],
+                                        uint vid [[vertex_id]]) {
+  float2 corner = float2(vid & 1, vid >> 1);
+  RasterizerData out;
+  out.paintIndex = 0;
+  out.ftcoord = mix(glyph.uvRect.xy, glyph.uvRect.zw, corner);
+  out.fpos = glyph.rect.xy + glyph.rect.zw * corner;
+  out.pos = float4(2.0 * out.fpos.x / uniforms.viewSize.x - 1.0,
+                   1.0 - 2.0 * out.fpos.y / uniforms.viewSize.y,
+                   0, 1);
+  out.pos = uniforms.matrix * out.pos;
+  return out;
+}
+
+// Paint table variants: the base instance of the draw indexes the paints of the frame.
+vertex RasterizerData vertexShaderPaintTable(Vertex vert [[stage_in]],
+                                             constant VertexUniforms& uniforms [[buffer(1)]],
+                                             uint instance [[instance_id]]) {
+  RasterizerData out = transformVertex(vert, uniforms);
+  out.paintIndex = instance;
+  return out;
+}
+
+fragment float4 fragmentShaderPaintTable(RasterizerData in [[stage_in]],
+                                         constant FragmentUniforms* paints [[buffer(2)]],
+                                         texture2d<float> texture [[texture(0)]],
+                                         sampler sampler [[sampler(0)]]) {
+  return shade(paints[in.paintIndex], in, texture, sampler);
+}
+
+fragment float4 fragmentShaderAAPaintTable(RasterizerData in [[stage_in]],
+                                           constant FragmentUniforms* paints [[buffer(2)]],
+                                           texture2d<float> texture [[texture(0)]],
+                                           sampler sampler [[sampler(0)]]) {
+  return shadeAA(paints[in.paintIndex], in, texture, sampler);
+}
 )";
 
 }
@@ -18,6 +18,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 #pragma once
+#include "shader_uniforms.h"
 #include <string>
 
 namespace iglu::nanovg {
@@ -32,6 +33,7 @@ out vec2 ftcoord;
 layout(std140) uniform VertexUniformBlock {
  mat4 matrix;
  vec2 viewSize;
+ float positionScale;
 }uniforms;
 )";
 
@@ -45,20 +47,86 @@ layout (location=1) out vec2 ftcoord;
 layout(set = 1, binding = 1, std140) uniform VertexUniformBlock {
  mat4 matrix;
  vec2 viewSize;
+ float positionScale;
+}uniforms;
+)";
+
+// Vulkan variant of openglVertexShaderHeader460 that passes the base instance of the draw, the
+// index of its paint in the paint table, to the fragment shader.
+static std::string openglVertexShaderHeader460PaintTable = R"(#version 460
+#define NVG_PAINT_TABLE
+layout(location = 0) in vec2 pos;
+layout(location = 1) in vec2 tcoord;
+
+layout (location=0) out vec2 fpos;
+layout (location=1) out vec2 ftcoord;
+layout (location=2) flat out int fpaint;
+
+layout(set = 1, binding = 1, std140) uniform VertexUniformBlock {
+ mat4 matrix;
+ vec2 viewSize;
+ float positionScale;
 }uniforms;
 )";
 
 static std::string openglVertexShaderBody = R"(
 void main() {
+#ifdef NVG_PAINT_TABLE
+  fpaint = gl_InstanceIndex;
+#endif
   ftcoord = tcoord;
-  fpos = pos;
-  gl_Position = vec4(2.0 * pos.x / uniforms.viewSize.x - 1.0,
-                     1.0 - 2.0 * pos.y / uniforms.viewSize.y,
+  fpos = pos * uniforms.positionScale;
+  gl_Position = vec4(2.0 * fpos.x / uniforms.viewSize.x - 1.0,
+                     1.0 - 2.0 * fpos.y / uniforms.viewSize.y,
                    0, 1);
   gl_Position = uniforms.matrix * gl_Position; 
 }
 )";
 
+// Vertex shader of NVG_GLYPH_INSTANCES: every instance is a glyph quad, drawn as a 4 vertex
+// strip whose corners are selected by the vertex index.
+static std::string openglGlyphVertexShaderHeader410 = R"(#version 410
+#define NVG_VERTEX_INDEX gl_VertexID
+layout(location = 0) in vec4 rect;
+layout(location = 1) in vec4 uvRect;
+
+out vec2 fpos;
+out vec2 ftcoord;
+
+layout(std140) uniform VertexUniformBlock {
+ mat4 matrix;
+ vec2 viewSize;
+ float positionScale;
+}uniforms;
+)";
+
+static std::string openglGlyphVertexShaderHeader460 = R"(#version 460
+#define NVG_VERTEX_INDEX gl_VertexIndex
+layout(location = 0) in vec4 rect;
+layout(location = 1) in vec4 uvRect;
+
+layout (location=0) out vec2 fpos;
+layout (location=1) out vec2 ftcoord;
+
+layout(set = 1, binding = 1, std140) uniform VertexUniformBlock {
+ mat4 matrix;
+ vec2 viewSize;
+ float positionScale;
+}uniforms;
+)";
+
+static std::string openglGlyphVertexShaderBody = R"(
+void main() {
+  vec2 corner = vec2(float(NVG_VERTEX_INDEX & 1), float(NVG_VERTEX_INDEX >> 1));
+  ftcoord = mix(uvRect.xy, uvRect.zw, corner);
+  fpos = rect.xy + rect.zw * corner;
+  gl_Position = vec4(2.0 * fpos.x / uniforms.viewSize.x - 1.0,
+                     1.0 - 2.0 * fpos.y / uniforms.viewSize.y,
+                   0, 1);
+  gl_Position = uniforms.matrix * gl_Position;
+}
+)";
+
 static std::string openglFragmentShaderHeader410 = R"(#version 410
 precision highp int; 
 precision highp float;
@@ -71,21 +139,7 @@ layout (location=0) out vec4 FragColor;
 uniform lowp sampler2D textureUnit;
 
 layout(std140) uniform FragmentUniformBlock {
-  mat3 scissorMat;
-  mat3 paintMat;
-  vec4 innerCol;
-  vec4 outerCol;
-  vec2 scissorExt;
-  vec2 scissorScale;
-  vec2 extent;
-  float radius;
-  float feather;
-  float strokeMult;
-  float strokeThr;
-  int texType;
-  int type;
-}uniforms;
-
+)" NVG_GLSL_FRAGMENT_UNIFORM_FIELDS R"(}uniforms;
 )";
 
 static std::string openglFragmentShaderHeader460 = R"(#version 460
@@ -100,25 +154,65 @@ layout (location=0) out vec4 FragColor;
 layout(set = 0, binding = 0)  uniform lowp sampler2D textureUnit;
 
 layout(set = 1, binding = 2, std140) uniform FragmentUniformBlock {
-  mat3 scissorMat;
-  mat3 paintMat;
-  vec4 innerCol;
-  vec4 outerCol;
-  vec2 scissorExt;
-  vec2 scissorScale;
-  vec2 extent;
-  float radius;
-  float feather;
-  float strokeMult;
-  float strokeThr;
-  int texType;
-  int type;
-}uniforms;
+)" NVG_GLSL_FRAGMENT_UNIFORM_FIELDS R"(}uniforms;
+)";
+
+// Vulkan variant of openglFragmentShaderHeader460 that reads the paint of the draw from push
+// constants instead of a uniform buffer, with the same layout.
+static std::string openglFragmentShaderHeader460PushConstants = R"(#version 460
+precision highp int; 
+precision highp float;
+
+layout (location=0) in vec2 fpos;
+layout (location=1) in vec2 ftcoord;
+
+layout (location=0) out vec4 FragColor;
+
+layout(set = 0, binding = 0)  uniform lowp sampler2D textureUnit;
+
+layout(push_constant) uniform FragmentUniformBlock {
+)" NVG_GLSL_FRAGMENT_UNIFORM_FIELDS R"(}uniforms;
+)";
+
+// Vulkan variant of openglFragmentShaderHeader460 that reads the paint of the draw from the paint
+// table, a storage buffer holding every paint of the frame.
+static std::string openglFragmentShaderHeader460PaintTable = R"(#version 460
+precision highp int; 
+precision highp float;
+
+layout (location=0) in vec2 fpos;
+layout (location=1) in vec2 ftcoord;
+layout (location=2) flat in int fpaint;
+
+layout (location=0) out vec4 FragColor;
+
+layout(set = 0, binding = 0)  uniform lowp sampler2D textureUnit;
+
+struct FragmentUniforms {
+)" NVG_GLSL_FRAGMENT_UNIFORM_FIELDS R"(};
+
+layout(set = 1, binding = 2, std430) readonly buffer PaintTable {
+  FragmentUniforms paints[];
+};
+
+#define uniforms paints[fpaint]
 )";
 
 static std::string openglNoAntiAliasingFragmentShaderBody = R"(
+vec2 scissorTransform(vec2 p) {
+  return mat2(uniforms.scissorMat) * p + uniforms.translate.xy;
+}
+
+vec2 paintTransform(vec2 p) {
+  return mat2(uniforms.paintMat) * p + uniforms.translate.zw;
+}
+
 float scissorMask(vec2 p) {
-  vec2 sc = (abs((uniforms.scissorMat * vec3(p, 1.0f)).xy)
+  // Negative extents: no scissor, or clipped by the scissor rect of the draw.
+  if (uniforms.scissorExt.x < 0.0) {
+    return 1.0;
+  }
+  vec2 sc = (abs(scissorTransform(p))
                   - uniforms.scissorExt)  * uniforms.scissorScale;
   sc = clamp(vec2(0.5f) - sc, 0.0, 1.0);
   return sc.x * sc.y;
@@ -130,6 +224,13 @@ float sdroundrect(vec2 pt) {
   return min(max(d.x, d.y), 0.0) + length(max(d, 0.0)) - uniforms.radius;
 }
 
+float sdellipse(vec2 pt) {
+  vec2 r = uniforms.extent;
+  float k0 = length(pt / r);
+  float k1 = length(pt / (r * r));
+  return k1 > 0.0 ? k0 * (k0 - 1.0) / k1 : -min(r.x, r.y);
+}
+
 float strokeMask(vec2 ftcoord) {
   return min(1.0, (1.0 - abs(ftcoord.x * 2.0 - 1.0)) * uniforms.strokeMult) * min(1.0, ftcoord.y);
 }
@@ -140,13 +241,19 @@ vec4 fragmentShaderNoAntiAliasing() {
     return vec4(0);
 
   if (uniforms.type == 0) {  // MNVG_SHADER_FILLGRAD
-    vec2 pt = (uniforms.paintMat * vec3(fpos, 1.0)).xy;
+    vec2 pt = paintTransform(fpos);
     float d = clamp((uniforms.feather * 0.5 + sdroundrect(pt))
                        / uniforms.feather, 0.0, 1.0);
     vec4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
     return color * scissor;
+  } else if (uniforms.type == 3) {  // MNVG_SHADER_FILLELLIPSE
+    vec2 pt = paintTransform(fpos);
+    float d = clamp((uniforms.feather * 0.5 + sdellipse(pt))
+                       / uniforms.feather, 0.0, 1.0);
+    vec4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
+    return color * scissor;
   } else if (uniforms.type == 1) {  // MNVG_SHADER_FILLIMG
-    vec2 pt = (uniforms.paintMat * vec3(fpos, 1.0)).xy / uniforms.extent;
+    vec2 pt = paintTransform(fpos) / uniforms.extent;
     vec4 color = texture(textureUnit, pt);
     if (uniforms.texType == 1)
       color = vec4(color.xyz * color.w, color.w);
@@ -172,8 +279,20 @@ void main(){
 )";
 
 static std::string openglAntiAliasingFragmentShaderBody = R"(
+vec2 scissorTransform(vec2 p) {
+  return mat2(uniforms.scissorMat) * p + uniforms.translate.xy;
+}
+
+vec2 paintTransform(vec2 p) {
+  return mat2(uniforms.paintMat) * p + uniforms.translate.zw;
+}
+
 float scissorMask(vec2 p) {
-  vec2 sc = (abs((uniforms.scissorMat * vec3(p, 1.0f)).xy)
+  // Negative extents: no scissor, or clipped by the scissor rect of the draw.
+  if (uniforms.scissorExt.x < 0.0) {
+    return 1.0;
+  }
+  vec2 sc = (abs(scissorTransform(p))
                   - uniforms.scissorExt)  * uniforms.scissorScale;
   sc = clamp(vec2(0.5f) - sc, 0.0, 1.0);
   return sc.x * sc.y;
@@ -185,6 +304,13 @@ float sdroundrect(vec2 pt) {
   return min(max(d.x, d.y), 0.0) + length(max(d, 0.0)) - uniforms.radius;
 }
 
+float sdellipse(vec2 pt) {
+  vec2 r = uniforms.extent;
+  float k0 = length(pt / r);
+  float k1 = length(pt / (r * r));
+  return k1 > 0.0 ? k0 * (k0 - 1.0) / k1 : -min(r.x, r.y);
+}
+
 float strokeMask(vec2 ftcoord) {
   return min(1.0, (1.0 - abs(ftcoord.x * 2.0 - 1.0)) * uniforms.strokeMult) * min(1.0, ftcoord.y);
 }
@@ -210,15 +336,23 @@ vec4 fragmentShaderAntiAliasing() {
     }
 
     if (uniforms.type == 0) {  // MNVG_SHADER_FILLGRAD
-      vec2 pt = (uniforms.paintMat * vec3(fpos, 1.0)).xy;
+      vec2 pt = paintTransform(fpos);
       float d = clamp((uniforms.feather * 0.5 + sdroundrect(pt))
                           / uniforms.feather, 0.0, 1.0);
       vec4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
       color *= scissor;
       color *= strokeAlpha;
       return color;
+    } else if (uniforms.type == 3) {  // MNVG_SHADER_FILLELLIPSE
+      vec2 pt = paintTransform(fpos);
+      float d = clamp((uniforms.feather * 0.5 + sdellipse(pt))
+                          / uniforms.feather, 0.0, 1.0);
+      vec4 color = mix(uniforms.innerCol, uniforms.outerCol, d);
+      color *= scissor;
+      color *= strokeAlpha;
+      return color;
     } else {  // MNVG_SHADER_FILLIMG
-      vec2 pt = (uniforms.paintMat * vec3(fpos, 1.0)).xy / uniforms.extent;
+      vec2 pt = paintTransform(fpos) / uniforms.extent;
       vec4 color = texture(textureUnit, pt);
       if (uniforms.texType == 1)
         color = vec4(color.xyz * color.w, color.w);
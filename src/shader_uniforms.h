@@ -0,0 +1,50 @@
+// Copyright (c) 2025 vinsentli
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+// Single definition of the fragment uniform block, shared by the C++ FragmentUniforms struct and
+// the GLSL 410, GLSL 460 and Metal shaders. Every row is one field:
+//   X(C++ type, GLSL type, Metal type, name)
+// All rows are 16-byte aligned groups, so std140, push constants, Metal and C++ agree on the
+// layout of the 128-byte block. Affine matrices are stored as a column-major 2x2 linear part
+// plus a translation: `scissorMat` and `paintMat` hold (a, b, c, d), `translate` holds the
+// scissor (e, f) in xy and the paint (e, f) in zw.
+#define NVG_FRAGMENT_UNIFORM_FIELDS(X)                          \
+  X(iglu::simdtypes::float4, vec4, float4, scissorMat)          \
+  X(iglu::simdtypes::float4, vec4, float4, paintMat)            \
+  X(iglu::simdtypes::float4, vec4, float4, translate)           \
+  X(iglu::simdtypes::float4, vec4, float4, innerCol)            \
+  X(iglu::simdtypes::float4, vec4, float4, outerCol)            \
+  X(iglu::simdtypes::float2, vec2, float2, scissorExt)          \
+  X(iglu::simdtypes::float2, vec2, float2, scissorScale)        \
+  X(iglu::simdtypes::float2, vec2, float2, extent)              \
+  X(float, float, float, radius)                                \
+  X(float, float, float, feather)                               \
+  X(float, float, float, strokeMult)                            \
+  X(float, float, float, strokeThr)                             \
+  X(int, int, int, texType)                                     \
+  X(int, int, int, type)
+
+#define NVG_GLSL_UNIFORM_FIELD(cppType, glslType, metalType, name) "  " #glslType " " #name ";\n"
+#define NVG_METAL_UNIFORM_FIELD(cppType, glslType, metalType, name) "  " #metalType " " #name ";\n"
+
+// String literals with the field declarations of the block, for the shader sources.
+#define NVG_GLSL_FRAGMENT_UNIFORM_FIELDS NVG_FRAGMENT_UNIFORM_FIELDS(NVG_GLSL_UNIFORM_FIELD)
+#define NVG_METAL_FRAGMENT_UNIFORM_FIELDS NVG_FRAGMENT_UNIFORM_FIELDS(NVG_METAL_UNIFORM_FIELD)